@@ -8,9 +8,15 @@
 
 #include <ugorji/conn/conn.h>
 #include <ugorji/ndb/conn.h>
+#include <ugorji/ndb/reuseport.h>
+#include <ugorji/ndb/uring.h>
 #include <ugorji/util/logging.h>
 
 ugorji::conn::Manager* connmgr_;
+ugorji::ndb::ReusePortServer* reuseportsrv_;
+#ifdef NDB_IO_URING
+ugorji::ndb::UringServer* uringsrv_;
+#endif
 
 // // run Server in main thread, and don't create a thread for the server.
 // // If set to false, we can test out signl handling well
@@ -23,7 +29,11 @@ int main(int argc, char** argv) {
     ugorji::util::Log::getInstance().minLevel_ = ugorji::util::Log::TRACE;
     ugorji::ndb::Manager mgr;
     int workers = -1;
+    int execWorkers = 0;
+    size_t zerocopyMin = 0;
     int port = 9999;
+    std::string engine = "epoll";
+    size_t uringBufs = 1024;
     // int maxWorkers = -1;
     bool clearOnStartup = false;
     std::string initfile = "init.cfg";
@@ -37,6 +47,14 @@ int main(int argc, char** argv) {
             initfile = argv[++i];
         } else if(arg == "-w" || arg == "-workers") {
             workers = std::stoi(argv[++i]);
+        } else if(arg == "-e" || arg == "-execworkers") {
+            execWorkers = std::stoi(argv[++i]);
+        } else if(arg == "-z" || arg == "-zerocopy") {
+            zerocopyMin = std::stoul(argv[++i]);
+        } else if(arg == "-n" || arg == "-engine") {
+            engine = argv[++i];
+        } else if(arg == "-b" || arg == "-uringbufs") {
+            uringBufs = std::stoul(argv[++i]);
         } else if(arg == "-k" || arg == "-perkind") {
             mgr.dbPerKind_ = memcmp("true", argv[++i], 4) == 0;
         } else if(arg == "-s" || arg == "-shards") {
@@ -46,6 +64,10 @@ int main(int argc, char** argv) {
             std::cout << "Usage: ndbserver " << std::endl
                       << "\t[-i|-initfile file] Default: init.cfg" << std::endl
                       << "\t[-p|-port portno] Default: 9999"  << std::endl
+                      << "\t[-e|-execworkers num] Default: 0 (one per core)" << std::endl
+                      << "\t[-z|-zerocopy minbytes] Default: 0 (never use MSG_ZEROCOPY)" << std::endl
+                      << "\t[-n|-engine epoll|reuseport|uring] Default: epoll" << std::endl
+                      << "\t[-b|-uringbufs num] Default: 1024 (registered receive buffers for uring)" << std::endl
                       << "\t[-k|-perkind true|false] Default: false" << std::endl
                       << "\t[-s|-shards shardMin shardRange] Default: 1, 1" << std::endl;
             return 0;
@@ -53,6 +75,17 @@ int main(int argc, char** argv) {
             clearOnStartup = memcmp("true", argv[++i], 4) == 0;
         }
     }
+    if(engine != "epoll" && engine != "reuseport" && engine != "uring") {
+        LOG(ERROR, "<ndbserver> unknown engine: %s", engine.c_str());
+        return 1;
+    }
+#ifndef NDB_IO_URING
+    if(engine == "uring") {
+        LOG(ERROR, "<ndbserver> engine uring is not supported: rebuild with NDB_IO_URING=1", 0);
+        return 1;
+    }
+    (void)uringBufs;
+#endif
     {
         std::fstream fs;
         fs.open(initfile);
@@ -66,11 +99,14 @@ int main(int argc, char** argv) {
         system(("rm -rf " + mgr.basedir_).c_str());
         system(("mkdir -p " + mgr.basedir_).c_str());
     }
-    LOG(INFO, "<ndbserver> %d, BaseDir: %s, ClearOnStartup: %d, dbPerKind: %d", 
-        port, mgr.basedir_.c_str(), clearOnStartup, mgr.dbPerKind_);
+    LOG(INFO, "<ndbserver> %d, BaseDir: %s, ClearOnStartup: %d, dbPerKind: %d, engine: %s", 
+        port, mgr.basedir_.c_str(), clearOnStartup, mgr.dbPerKind_, engine.c_str());
 
-    auto connmgr = std::make_unique<ugorji::conn::Manager>(port, workers);
-    connmgr_ = connmgr.get();
+    std::unique_ptr<ugorji::conn::Manager> connmgr;
+    if(engine == "epoll") {
+        connmgr = std::make_unique<ugorji::conn::Manager>(port, workers);
+        connmgr_ = connmgr.get();
+    }
 
     //always install signal handler in main thread, and before making other threads.
     LOG(INFO, "<ndbserver> Setup Signal Handler (SIGINT, SIGTERM, SIGUSR1, SIGUSR2)", 0);
@@ -80,6 +116,10 @@ int main(int argc, char** argv) {
                            connmgr_->close();
                            connmgr_ = nullptr;
                        }
+                       if(reuseportsrv_ != nullptr) reuseportsrv_->close();
+#ifdef NDB_IO_URING
+                       if(uringsrv_ != nullptr) uringsrv_->close();
+#endif
                    };
     auto sighdlr_noop = [](int sig) {};
     std::signal(SIGINT,  sighdlr); // ctrl-c
@@ -88,24 +128,60 @@ int main(int argc, char** argv) {
     std::signal(SIGUSR2, sighdlr_noop); // used to interrupt epoll_wait
 
     std::string err = "";
+    ugorji::ndb::Pool pool(execWorkers);
+    ugorji::ndb::ReqHandler reqHdlr(&mgr, &pool);
+
+    if(engine == "reuseport") {
+        // one accept/epoll loop per worker, each owning the connections it accepts
+        ugorji::ndb::ReusePortServer srv(&reqHdlr, &pool, port, workers, zerocopyMin);
+        srv.open(err);
+        if(err.size() == 0) {
+            reuseportsrv_ = &srv;
+            srv.run(err);
+            reuseportsrv_ = nullptr;
+        }
+        pool.close();
+        if(err.size() > 0) LOG(ERROR, "%s", err.data());
+        LOG(INFO, "<main>: shutdown completed", 0);
+        return err.size() > 0 ? 1 : 0;
+    }
+
+#ifdef NDB_IO_URING
+    if(engine == "uring") {
+        ugorji::ndb::UringServer srv(&reqHdlr, &pool, port, uringBufs);
+        srv.open(err);
+        if(err.size() == 0) {
+            uringsrv_ = &srv;
+            srv.run(err);
+            uringsrv_ = nullptr;
+        }
+        pool.close();
+        if(err.size() > 0) LOG(ERROR, "%s", err.data());
+        LOG(INFO, "<main>: shutdown completed", 0);
+        return err.size() > 0 ? 1 : 0;
+    }
+#endif
+
     connmgr->open(err);
     if(err.size() > 0) {
         LOG(ERROR, "%s", err.data());
         return 1;
     }
-
-    ugorji::ndb::ReqHandler reqHdlr(&mgr);
     
     std::vector<std::unique_ptr<ugorji::ndb::ConnHandler>> hdlrs;
     auto fn = [&]() mutable -> decltype(auto) {
-                  auto hh = std::make_unique<ugorji::ndb::ConnHandler>(&reqHdlr);
+                  auto hh = std::make_unique<ugorji::ndb::ConnHandler>(&reqHdlr, &pool);
                   auto hdlr = hh.get();
+                  hdlr->zerocopyMin_ = zerocopyMin;
                   hdlrs.push_back(std::move(hh));
                   return *hdlr;
               };
     
     connmgr->run(fn, true);
     connmgr->wait();
+    // so requests still running (and parked streams) let go of the connections
+    for(auto& h : hdlrs) h->stopFds();
+    pool.close();
     
     int exitcode = (connmgr->hasServerErrors() ? 1 : 0);
 
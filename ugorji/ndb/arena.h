@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+
+namespace ugorji {
+namespace ndb {
+
+// Arena is a bump allocator for the short-lived allocations of a request
+// (e.g. the codec_value arrays of its response). Nothing is freed on its own:
+// everything goes at once on reset (which keeps the first block for reuse) or destruction.
+//
+// It is not thread-safe. A request only ever runs on one thread at a time.
+class Arena {
+private:
+    static const size_t BLOCK_SIZE = 4096;
+    static const size_t ALIGN = alignof(std::max_align_t);
+    std::vector<char*> blocks_;
+    // allocations too big for a block get one of their own
+    std::vector<char*> large_;
+    char* pos_ = nullptr;
+    size_t avail_ = 0;
+    void grow() {
+        auto b = (char*)malloc(BLOCK_SIZE);
+        blocks_.push_back(b);
+        pos_ = b;
+        avail_ = BLOCK_SIZE;
+    }
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        for(auto b : blocks_) free(b);
+        for(auto b : large_) free(b);
+    }
+    void* alloc(size_t n) {
+        n = (n + ALIGN - 1) & ~(ALIGN - 1);
+        if(n > BLOCK_SIZE / 4) {
+            auto b = (char*)malloc(n);
+            large_.push_back(b);
+            return b;
+        }
+        if(n > avail_) grow();
+        auto p = pos_;
+        pos_ += n;
+        avail_ -= n;
+        return p;
+    }
+    // calloc returns n zeroed Ts (which must be trivially destructible)
+    template<typename T>
+    T* calloc(size_t n) {
+        auto p = alloc(n * sizeof(T));
+        memset(p, 0, n * sizeof(T));
+        return (T*)p;
+    }
+    void reset() {
+        for(auto b : large_) free(b);
+        large_.clear();
+        if(blocks_.empty()) return;
+        for(size_t i = 1; i < blocks_.size(); i++) free(blocks_[i]);
+        blocks_.resize(1);
+        pos_ = blocks_[0];
+        avail_ = BLOCK_SIZE;
+    }
+};
+
+} //close namespace ndb
+} // close namespace ugorji
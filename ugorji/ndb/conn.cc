@@ -6,10 +6,16 @@
 #include <mutex>
 #include <chrono>
 #include <iostream>
-#include <atomic>
+#include <queue>
+#include <algorithm>
+#include <unordered_map>
 
 //#include <string.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 #include <fcntl.h>
 //#include <sys/types.h>
 #include <signal.h>
@@ -22,17 +28,137 @@
 #include <ugorji/util/bigendian.h>
 #include "conn.h"
 
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
 namespace ugorji { 
 namespace ndb { 
 
-const size_t FD_BUF_INCR = 256; // ugorji::conn::CONN_BUF_INCR;
+// max size of a single request frame
+const size_t MAX_REQ_LEN = 64 << 20;
+
+// a streamed query result is flushed as an intermediate response once it has this many bytes
+const size_t STREAM_CHUNK_BYTES = 256 << 10;
+
+// a streamed query is suspended till the client catches up once this many bytes are queued up
+// to be written on the connection.
+const size_t MAX_STREAM_BUFFERED = 1 << 20;
 
-const bool GET_VIA_ITER = false; // Iteration doesn't support bloom filter optimization
+// rows at least this size, which are pinned by the iterator, are written out in place.
+// Smaller ones are copied into the response buffer, as an iovec per row costs more than the copy.
+const size_t IOV_REF_MIN = 128;
+
+// a query-and-fetch ('F') looks up the entities of its rows in batches of this many,
+// each on the pool as soon as it is full, while the scan goes on.
+const size_t FETCH_BATCH = 64;
+
+// flags of a query's mode param (params[11])
+const uint64_t QUERY_ALL_SHARDS = 1; // run it on every shard, merging the rows in key order
+const uint64_t QUERY_COUNT = 2;      // return the number of rows (up to limit), not the rows
+const uint64_t QUERY_EXISTS = 4;     // return whether any row matches, not the rows
 
 codec_encode encoder = codec_binc_encode;
 codec_decode decoder = codec_binc_decode;
 
-std::atomic<size_t> SEQ;
+// encodeAppend encodes v at the end of out
+void encodeAppend(codec_value* v, slice_bytes* out, char** err) {
+    slice_bytes tmp {};
+    encoder(v, &tmp, err);
+    if(*err == nullptr) ::slice_bytes_append(out, tmp.bytes.v, tmp.bytes.len);
+    free(tmp.bytes.v);
+}
+
+// bincWriteLen writes the binc descriptor (vd is one of BINC_VD_*) and length n of a value, i.e.
+// all of its encoding ahead of its contents. The parts of a response which we lay out directly
+// (so that large results are not first copied into a codec_value tree and then encoded) are
+// framed with it. This must match codec_binc_encode.
+void bincWriteLen(slice_bytes* out, uint8_t vd, uint64_t n) {
+    uint8_t b[9];
+    size_t sz = 1;
+    vd = vd << 4;
+    if(n < 12) {
+        b[0] = vd | (uint8_t)(n + 4);
+    } else if(n <= 0xff) {
+        b[0] = vd;
+        b[1] = (uint8_t)n;
+        sz = 2;
+    } else if(n <= 0xffff) {
+        b[0] = vd | 0x01;
+        b[1] = (uint8_t)(n >> 8);
+        b[2] = (uint8_t)n;
+        sz = 3;
+    } else if(n <= 0xffffffff) {
+        b[0] = vd | 0x02;
+        for(int i = 0; i < 4; i++) b[1+i] = (uint8_t)(n >> (8*(3-i)));
+        sz = 5;
+    } else {
+        b[0] = vd | 0x03;
+        util_big_endian_write_uint64(&b[1], n);
+        sz = 9;
+    }
+    ::slice_bytes_append(out, b, sz);
+}
+
+// appendSeg adds a segment, merging it with the previous one if contiguous in out_
+void appendSeg(std::vector<outSeg>& segs, outSeg sg) {
+    if(sg.ext == nullptr && !segs.empty()) {
+        auto& b = segs.back();
+        if(b.ext == nullptr && b.off + b.len == sg.off) {
+            b.len += sg.len;
+            return;
+        }
+    }
+    segs.push_back(sg);
+}
+
+// writeRowsOut lays out the response [id, err, rows] (or [id, err, rows, more] if more >= 0,
+// or [id, err, rows, more, cursor] if cursor is set), where the numRows rows are already
+// laid out in rows (against f.out_).
+void writeRowsOut(reqFrame& f, codec_value* id, codec_value* errv, size_t numRows, 
+                  std::vector<outSeg>& rows, int more, char** err, const std::string* cursor = nullptr) {
+    size_t off = f.out_.bytes.len;
+    if(cursor != nullptr && more < 0) more = 0;
+    bincWriteLen(&f.out_, BINC_VD_ARRAY, (more < 0) ? 3 : (cursor == nullptr ? 4 : 5));
+    encodeAppend(id, &f.out_, err);
+    if(*err != nullptr) return;
+    encodeAppend(errv, &f.out_, err);
+    if(*err != nullptr) return;
+    bincWriteLen(&f.out_, BINC_VD_ARRAY, numRows);
+    f.segs_.push_back(outSeg{nullptr, off, f.out_.bytes.len - off});
+    f.segs_.insert(f.segs_.end(), rows.begin(), rows.end());
+    if(more < 0) return;
+    codec_value vmore;
+    vmore.type = CODEC_VALUE_BOOL;
+    vmore.v.vBool = more > 0;
+    off = f.out_.bytes.len;
+    encodeAppend(&vmore, &f.out_, err);
+    if(*err != nullptr) return;
+    if(cursor != nullptr) {
+        bincWriteLen(&f.out_, BINC_VD_BYTES, cursor->size());
+        ::slice_bytes_append(&f.out_, (void*)cursor->data(), cursor->size());
+    }
+    appendSeg(f.segs_, outSeg{nullptr, off, f.out_.bytes.len - off});
+}
+
+// the cursor of the intermediate responses of a streamed query (only the final one has it)
+const std::string NO_CURSOR;
+
+void fastPutUint(slice_bytes* out, uint64_t v, size_t k);
+
+// appendRow lays out a bytes value in rows: its header (binc, or a u32 length for the fast protocol)
+// is written into out, and the bytes are referenced in place if stable (i.e. kept alive by the frame
+// till it is written out) and large enough, else copied into out.
+void appendRow(slice_bytes& out, std::vector<outSeg>& rows, const leveldb::Slice& sl, 
+               bool stable, bool fast) {
+    size_t off = out.bytes.len;
+    bool ref = stable && sl.size() >= IOV_REF_MIN;
+    if(fast) fastPutUint(&out, sl.size(), 4);
+    else bincWriteLen(&out, BINC_VD_BYTES, sl.size());
+    if(!ref) ::slice_bytes_append(&out, (void*)sl.data(), sl.size());
+    appendSeg(rows, outSeg{nullptr, off, out.bytes.len - off});
+    if(ref) appendSeg(rows, outSeg{sl.data(), 0, sl.size()});
+}
 
 bool to_codec_value(std::string& serr, codec_value& out1) {
     if(serr.empty()) return false;
@@ -42,16 +168,6 @@ bool to_codec_value(std::string& serr, codec_value& out1) {
     return true;
 }
 
-bool to_codec_value(leveldb::Slice* serr, codec_value& out1) {
-    if(serr != nullptr) {
-        out1.type = CODEC_VALUE_STRING;
-        out1.v.vString.bytes.v = (char*)serr->data();
-        out1.v.vString.bytes.len = serr->size();
-        return true;
-    }
-    return false;
-}
-
 
 struct dbBatchUpdateT {
     std::vector<leveldb::Slice> putkeys;
@@ -78,40 +194,399 @@ public:
     }
 };
 
-class dbAndIterGuard {
+// multiGet looks up keys with one batched MultiGet per db (as keys may be spread across
+// shards), scattering the values back into vals in request order.
+// The per-db lookups run in parallel on the pool.
+// As with a single get, the request fails with the error of the first key (in order) not found.
+// If snap (a snapshot token) is not 0, each db is read as of its snapshot for it.
+void multiGet(Manager* mgr, Pool* pool, std::vector<leveldb::Slice>& keys, 
+              std::vector<leveldb::PinnableSlice>& vals, std::string& serr, uint64_t snap = 0) {
+    size_t n = keys.size();
+    vals.resize(n);
+    std::vector<leveldb::Status> ss(n);
+    std::unordered_map<Ndb*, std::vector<size_t>> byDb;
+    std::unordered_map<Ndb*, std::shared_ptr<const leveldb::Snapshot>> snaps;
+    for(size_t i = 0; i < n; ++i) {
+        auto db = mgr->ndbForKey(keys[i], serr);
+        if(!serr.empty()) return;
+        byDb[db].push_back(i);
+        if(snap != 0 && snaps.find(db) == snaps.end()) {
+            snaps[db] = mgr->snapshotFor(db, snap, serr);
+            if(!serr.empty()) return;
+        }
+    }
+    if(byDb.size() == 1) {
+        auto db = byDb.begin()->first;
+        db->multiGet(n, keys.data(), vals.data(), ss.data(), snap != 0 ? snaps[db].get() : nullptr);
+    } else {
+        // each lookup writes only to the indexes of its own keys
+        TaskGroup tg(pool);
+        for(auto& e : byDb) {
+            auto sp = (snap != 0) ? snaps[e.first].get() : nullptr;
+            tg.run([&keys, &vals, &ss, db = e.first, &idx = e.second, sp] {
+                       size_t m = idx.size();
+                       std::vector<leveldb::Slice> ks(m);
+                       std::vector<leveldb::PinnableSlice> vs(m);
+                       std::vector<leveldb::Status> s2(m);
+                       for(size_t j = 0; j < m; ++j) ks[j] = keys[idx[j]];
+                       db->multiGet(m, ks.data(), vs.data(), s2.data(), sp);
+                       for(size_t j = 0; j < m; ++j) {
+                           vals[idx[j]] = std::move(vs[j]);
+                           ss[idx[j]] = std::move(s2[j]);
+                       }
+                   });
+        }
+        tg.wait();
+    }
+    for(size_t i = 0; i < n; ++i) {
+        if(ss[i].ok()) continue;
+        serr = ss[i].IsNotFound() ? NOT_FOUND_ERROR : ss[i].ToString();
+        return;
+    }
+}
+
+// updateAll writes the batch for each db, in parallel on the pool.
+// If any fail, serr is the error of one of them.
+void updateAll(Pool* pool, db2BatchUpdateT& db2bt, std::string& serr) {
+    if(db2bt.m_.size() == 1) {
+        auto& e = *db2bt.m_.begin();
+        e.first->update(e.second->putkeys, e.second->putvalues, e.second->delkeys, serr);
+        return;
+    }
+    std::vector<std::string> errs(db2bt.m_.size());
+    TaskGroup tg(pool);
+    size_t i = 0;
+    for(auto& e : db2bt.m_) {
+        tg.run([db = e.first, bt = e.second.get(), &err = errs[i++]] {
+                   db->update(bt->putkeys, bt->putvalues, bt->delkeys, err);
+               });
+    }
+    tg.wait();
+    for(auto& err : errs) {
+        if(err.empty()) continue;
+        serr = err;
+        return;
+    }
+}
+
+// setShard sets the shard of an entity key: the low 12 bits of its first 2 bytes.
+void setShard(std::string& k, uint16_t shard) {
+    if(k.size() < 2) return;
+    k[0] = (char)(((uint8_t)k[0] & 0xf0) | ((shard >> 8) & 0x0f));
+    k[1] = (char)(shard & 0xff);
+}
+
+// shardScan is the scan of one shard, in a query across all shards (see shardMerge).
+// The scan references its seek keys, so it is not moved once open.
+class shardScan {
 public:
-    std::unordered_map<Ndb*, leveldb::Iterator*> m_;
-    ~dbAndIterGuard() {
-        for(auto iter = m_.begin(); iter != m_.end(); ++iter) delete iter->second;
+    std::string k1;
+    std::string k2;
+    Ndb* db = nullptr;
+    std::shared_ptr<const leveldb::Snapshot> sp;
+    queryScan q;
+    std::shared_ptr<leveldb::Iterator> iter;
+    // row is a copy of the current row of the scan, if has is set
+    std::string row;
+    bool has = false;
+    std::string err;
+    // pull moves the scan on to its next row, skipping rows too short to have the shard bytes
+    // (which can't be ordered across shards, and are not entities).
+    void pull() {
+        do {
+            has = false;
+            if(q.ended) return;
+            db->queryRun(q, [this] (leveldb::Slice& sl) {
+                                row.assign(sl.data(), sl.size());
+                                has = true;
+                                return false;
+                            }, err);
+        } while(has && row.size() < 2);
+        if(!err.empty()) has = false;
     }
-    leveldb::Iterator* getIter(Ndb* n) {
-        leveldb::Iterator* iter;
-        auto niter = m_.find(n);
-        if(niter == m_.end()) {
-            iter = n->db_->NewIterator(n->ropt_);
-            m_[n] = iter;
-        } else {
-            iter = niter->second;
+};
+
+// forShards sets up the scan of every shard in [shardMin_, shardMin_+shardRange_), with the
+// shard in seekpos1 and seekpos2 set to it (and its db, and its snapshot if snap is not 0),
+// and runs fn on each (with its index) in parallel on the pool.
+// If any fail, serr is the error of the first (in shard order).
+void forShards(Manager* mgr, Pool* pool, 
+               const leveldb::Slice seekpos1, const leveldb::Slice seekpos2, uint64_t snap,
+               std::vector<std::unique_ptr<shardScan>>& scans, 
+               std::function<void (size_t, shardScan&)> fn, std::string& serr) {
+    size_t n = mgr->shardRange_;
+    scans.resize(n);
+    {
+        TaskGroup tg(pool);
+        for(size_t i = 0; i < n; ++i) {
+            scans[i] = std::make_unique<shardScan>();
+            uint16_t shard = mgr->shardMin_ + i;
+            tg.run([=, &fn, &s = *scans[i]] {
+                       s.k1 = seekpos1.ToString();
+                       s.k2 = seekpos2.ToString();
+                       setShard(s.k1, shard);
+                       setShard(s.k2, shard);
+                       leveldb::Slice sk1(s.k1);
+                       s.db = mgr->ndbForKey(sk1, s.err);
+                       if(!s.err.empty()) return;
+                       if(snap != 0) s.sp = mgr->snapshotFor(s.db, snap, s.err);
+                       if(!s.err.empty()) return;
+                       fn(i, s);
+                   });
+        }
+    }
+    for(auto& s : scans) {
+        if(s->err.empty()) continue;
+        serr = s->err;
+        return;
+    }
+}
+
+// countShards counts the rows of an entity query across all shards (see queryShards),
+// returning up to limit of them after skipping offset.
+size_t countShards(Manager* mgr, Pool* pool, 
+                   const leveldb::Slice seekpos1, const leveldb::Slice seekpos2,
+                   uint8_t kindid, uint8_t shapeid, bool ancestorOnly, bool withCursor,
+                   uint8_t lastFilterOp, size_t offset, size_t limit, uint64_t snap, std::string& serr) {
+    size_t perShard = (offset + limit < limit) ? SIZE_MAX : offset + limit;
+    std::vector<size_t> counts(mgr->shardRange_);
+    std::vector<std::unique_ptr<shardScan>> scans;
+    forShards(mgr, pool, seekpos1, seekpos2, snap, scans, [&] (size_t i, shardScan& s) {
+                  counts[i] = s.db->query(leveldb::Slice(s.k1), leveldb::Slice(s.k2), kindid, shapeid, 
+                                          ancestorOnly, withCursor, lastFilterOp, 0, perShard, 
+                                          [] (leveldb::Slice&) { return true; }, s.err,
+                                          nullptr, nullptr, s.sp.get());
+              }, serr);
+    if(!serr.empty()) return 0;
+    size_t total = 0;
+    for(auto c : counts) total += c;
+    total = (total > offset) ? total - offset : 0;
+    return std::min(total, limit);
+}
+
+// shardMerge merges the rows of an entity query across all shards in key order (ignoring
+// the shard), pulling one row at a time from each shard's scan as it is needed, so only a
+// row per shard is held at a time. Each shard's scan is limited to offset+limit rows, as
+// the offset can't be split up across them.
+class shardMerge {
+public:
+    std::vector<std::unique_ptr<shardScan>> scans;
+    // open opens the scan of each shard, in parallel on the pool, and reads its first row.
+    void open(Manager* mgr, Pool* pool, 
+              const leveldb::Slice seekpos1, const leveldb::Slice seekpos2,
+              uint8_t kindid, uint8_t shapeid, bool ancestorOnly, bool withCursor,
+              uint8_t lastFilterOp, size_t offset, size_t limit, uint64_t snap, std::string& serr) {
+        forward_ = ancestorOnly || (lastFilterOp != F_LTE && lastFilterOp != F_LT);
+        skip_ = offset;
+        left_ = limit;
+        size_t perShard = (offset + limit < limit) ? SIZE_MAX : offset + limit;
+        forShards(mgr, pool, seekpos1, seekpos2, snap, scans, [=] (size_t, shardScan& s) {
+                      s.db->queryOpen(leveldb::Slice(s.k1), leveldb::Slice(s.k2), kindid, shapeid, 
+                                      ancestorOnly, withCursor, lastFilterOp, 0, perShard, nullptr, 
+                                      s.sp.get(), s.q, s.iter, s.err);
+                      if(s.err.empty()) s.pull();
+                  }, serr);
+        if(!serr.empty()) return;
+        for(size_t i = 0; i < scans.size(); ++i) {
+            if(scans[i]->has) heap_.push_back(i);
         }
-        return iter;
+        std::make_heap(heap_.begin(), heap_.end(), after{this});
     }
+    // next sets row to the next merged row (valid till the next call), returning false once
+    // there are no more, or on an error (in serr).
+    bool next(leveldb::Slice& row, std::string& serr) {
+        while(true) {
+            if(last_ < scans.size()) {
+                // move the shard of the last row on (so that row stayed valid till now)
+                auto& s = *scans[last_];
+                s.pull();
+                if(!s.err.empty()) {
+                    serr = s.err;
+                    return false;
+                }
+                if(s.has) {
+                    heap_.push_back(last_);
+                    std::push_heap(heap_.begin(), heap_.end(), after{this});
+                }
+                last_ = SIZE_MAX;
+            }
+            if(left_ == 0 || heap_.empty()) return false;
+            std::pop_heap(heap_.begin(), heap_.end(), after{this});
+            last_ = heap_.back();
+            heap_.pop_back();
+            if(skip_ > 0) {
+                skip_--;
+                continue;
+            }
+            left_--;
+            row = leveldb::Slice(scans[last_]->row);
+            return true;
+        }
+    }
+private:
+    // heap_ has the indexes of the shards with a current row, ordered on the rows past their shard bytes
+    std::vector<size_t> heap_;
+    size_t last_ = SIZE_MAX;
+    size_t skip_ = 0;
+    size_t left_ = 0;
+    bool forward_ = true;
+    // after orders the heap so its top is the shard whose row comes first
+    struct after {
+        shardMerge* m;
+        bool operator()(size_t a, size_t b) const {
+            auto& x = m->scans[a]->row;
+            auto& y = m->scans[b]->row;
+            int c = leveldb::Slice(x.data() + 2, x.size() - 2).compare(leveldb::Slice(y.data() + 2, y.size() - 2));
+            if(c == 0) return a > b;
+            return m->forward_ ? (c > 0) : (c < 0);
+        }
+    };
 };
 
+// queryShards runs an entity query on every shard in [shardMin_, shardMin_+shardRange_),
+// with the shard in seekpos1 and seekpos2 set to each in turn, and calls iterFn for up to
+// limit of their rows merged in key order (see shardMerge), after skipping offset.
+void queryShards(Manager* mgr, Pool* pool, 
+                 const leveldb::Slice seekpos1, const leveldb::Slice seekpos2,
+                 uint8_t kindid, uint8_t shapeid, bool ancestorOnly, bool withCursor,
+                 uint8_t lastFilterOp, size_t offset, size_t limit,
+                 std::function<bool (leveldb::Slice&)> iterFn, uint64_t snap, std::string& serr) {
+    shardMerge m;
+    m.open(mgr, pool, seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+           lastFilterOp, offset, limit, snap, serr);
+    if(!serr.empty()) return;
+    leveldb::Slice row;
+    while(m.next(row, serr)) {
+        if(!iterFn(row)) return;
+    }
+}
 
-// Get codec_value from bytes, call appropriate function, and write out value
-void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
-    fprintf(stderr, ">>>>>> ReqHandler::handle called\n");
+// fetchBatch is a batch of entity keys (copied out of the scan) and their values.
+class fetchBatch {
+public:
+    std::vector<std::string> keys;
+    std::vector<leveldb::PinnableSlice> vals;
+    std::vector<leveldb::Status> ss;
+    std::string err;
+    // fetch looks up the keys, with a MultiGet per db (as of the snapshot token snap, if not 0).
+    void fetch(Manager* mgr, uint64_t snap) {
+        size_t n = keys.size();
+        vals.resize(n);
+        ss.resize(n);
+        std::unordered_map<Ndb*, std::vector<size_t>> byDb;
+        for(size_t i = 0; i < n; ++i) {
+            leveldb::Slice k(keys[i]);
+            auto db = mgr->ndbForKey(k, err);
+            if(!err.empty()) return;
+            byDb[db].push_back(i);
+        }
+        for(auto& e : byDb) {
+            std::shared_ptr<const leveldb::Snapshot> sp;
+            if(snap != 0) sp = mgr->snapshotFor(e.first, snap, err);
+            if(!err.empty()) return;
+            auto& idx = e.second;
+            size_t m = idx.size();
+            std::vector<leveldb::Slice> ks(m);
+            std::vector<leveldb::PinnableSlice> vs(m);
+            std::vector<leveldb::Status> s2(m);
+            for(size_t j = 0; j < m; ++j) ks[j] = keys[idx[j]];
+            e.first->multiGet(m, ks.data(), vs.data(), s2.data(), sp.get());
+            for(size_t j = 0; j < m; ++j) {
+                vals[idx[j]] = std::move(vs[j]);
+                ss[idx[j]] = std::move(s2[j]);
+            }
+        }
+    }
+};
+
+// appendPairs appends the keys found in batches, and their values, to the rows of a frame:
+// the keys are copied, and the values (moved into its values_) referenced in place.
+void appendPairs(reqFrame& out, std::vector<std::shared_ptr<fetchBatch>>& bs, 
+                 std::vector<outSeg>& rows, size_t& numRows) {
+    size_t n = out.values_.size();
+    for(auto& b : bs) {
+        for(auto& s : b->ss) n += s.ok() ? 1 : 0;
+    }
+    // reserved up front, so the values referenced in place don't move
+    out.values_.reserve(n);
+    for(auto& b : bs) {
+        for(size_t i = 0; i < b->keys.size(); ++i) {
+            if(!b->ss[i].ok()) continue;
+            out.values_.push_back(std::move(b->vals[i]));
+            appendRow(out.out_, rows, leveldb::Slice(b->keys[i]), false, false);
+            appendRow(out.out_, rows, out.values_.back(), true, false);
+            numRows += 2;
+        }
+    }
+}
+
+// queryStream is the scan of a streamed query, which lives on its frame (see runStream).
+// The iterator (and so the db's view as of the start of the scan) and snapshot are held
+// while the scan is suspended. A query across all shards has its merge instead.
+class queryStream {
+public:
+    Ndb* db = nullptr;
+    queryScan q;
+    std::shared_ptr<leveldb::Iterator> iter;
+    std::unique_ptr<shardMerge> merge;
+    std::shared_ptr<const leveldb::Snapshot> snap;
+    codec_value id {};
+    size_t chunkRows = 0;
+    bool withCursor = false;
+    queryCursor cursor;
+    // A query-and-fetch streams the entities of its rows instead (see runFetch): batch is
+    // being filled from the scan, inflight is being fetched on fetches, and done are fetched
+    // batches held for the final response.
+    bool fetch = false;
+    uint64_t snapToken = 0;
+    std::shared_ptr<fetchBatch> batch;
+    std::shared_ptr<fetchBatch> inflight;
+    std::vector<std::shared_ptr<fetchBatch>> done;
+    std::unique_ptr<TaskGroup> fetches;
+};
+
+// Get codec_value from bytes, and extract the request id.
+// The id is what the client uses to match a response to its request,
+// as responses are written out in the order they complete.
+void ReqHandler::decode(reqFrame& f, char** err) {
+    *err = nullptr;
+    if(f.fast_) {
+        decodeFast(f, err);
+        return;
+    }
+    decoder(f.in_, &f.cvIn_, err);
+    if(*err != nullptr) return;
+    codec_value& cvIn = f.cvIn_;
+    if(cvIn.type != CODEC_VALUE_ARRAY || cvIn.v.vArray.len < 3 ||
+       cvIn.v.vArray.v[0].type != CODEC_VALUE_POS_INT) {
+        *err = (char*)&("Invalid request. Must be [id, method, params] with an unsigned int id"[0]);
+        return;
+    }
+    f.id_ = cvIn.v.vArray.v[0].v.vUint64;
+}
+
+// Call appropriate function for decoded request, and write out value
+void ReqHandler::handle(reqFrame& f, char** err) {
+    // a suspended stream picks up where it left off
+    if(f.stream_) {
+        if(f.stream_->fetch) runFetch(f, err);
+        else runStream(f, err);
+        return;
+    }
+    if(f.fast_) {
+        handleFast(f, err);
+        return;
+    }
     // req: [ id, method, paramsArr]
     // resp:[ id, error, result]
-    codec_value cvIn, cvOut;
+    codec_value& cvIn = f.cvIn_;
+    codec_value cvOut;
     
     *err = nullptr;
-    decoder(in, &cvIn, err);
-    if(*err != nullptr) return;
 
     cvOut.type = CODEC_VALUE_ARRAY;
     cvOut.v.vArray.len = 3;
-    cvOut.v.vArray.v = (codec_value*)calloc(3, sizeof(codec_value));
+    cvOut.v.vArray.v = f.arena_.calloc<codec_value>(3);
     cvOut.v.vArray.v[0] = cvIn.v.vArray.v[0];
     for(int i = 1; i < 3; i++) {
         cvOut.v.vArray.v[i].type = CODEC_VALUE_NIL;
@@ -129,6 +604,16 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
     // int pi = 0;
     codec_value& out1 = cvOut.v.vArray.v[1];
     codec_value& out2 = cvOut.v.vArray.v[2];
+    // if rowsOut, the result is an array of the numRows rows laid out in rows.
+    // if streamed, the result is sent as a series of [id, err, rows, more] responses.
+    bool rowsOut = false;
+    bool streamed = false;
+    // if cursor is set (by a query with a cursor param), the cursor for its next page goes out
+    // as the last element of the response (see writeRowsOut).
+    queryCursor qc;
+    queryCursor* cursor = nullptr;
+    size_t numRows = 0;
+    std::vector<outSeg> rows;
 
     switch(cvIn.v.vArray.v[1].v.vString.bytes.v[0]) {
     case 'N':
@@ -155,6 +640,32 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
         out2.v.vUint64 = nextval;
     }
     break;
+    case 'R':
+    {
+        // reserve: [key, count, initVal] => [start, end)
+        if(params.len < 3 || 
+           params.v[0].type != CODEC_VALUE_BYTES || 
+           params.v[1].type != CODEC_VALUE_POS_INT ||
+           params.v[2].type != CODEC_VALUE_POS_INT ||
+           params.v[1].v.vUint64 > UINT32_MAX) {
+            serr = "Invalid input";
+            if(to_codec_value(serr, out1)) break;
+        }
+        leveldb::Slice key(params.v[0].v.vBytes.bytes.v, params.v[0].v.vBytes.bytes.len);
+        auto db = mgr_->ndbForKey(key, serr);
+        if(to_codec_value(serr, out1)) break;
+        uint64_t start, end;
+        db->reserve(key, (uint32_t)params.v[1].v.vUint64, params.v[2].v.vUint64, &start, &end, serr);
+        if(to_codec_value(serr, out1)) break;
+        out2.type = CODEC_VALUE_ARRAY;
+        out2.v.vArray.len = 2;
+        out2.v.vArray.v = f.arena_.calloc<codec_value>(2);
+        out2.v.vArray.v[0].type = CODEC_VALUE_POS_INT;
+        out2.v.vArray.v[0].v.vUint64 = start;
+        out2.v.vArray.v[1].type = CODEC_VALUE_POS_INT;
+        out2.v.vArray.v[1].v.vUint64 = end;
+    }
+    break;
     case 'G': 
     {
         LOG(TRACE, "Get: #keys: %u", params.v[0].v.vArray.len);
@@ -163,34 +674,20 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
             keys[i] = leveldb::Slice(params.v[0].v.vArray.v[i].v.vBytes.bytes.v, 
                                      params.v[0].v.vArray.v[i].v.vBytes.bytes.len);
         }
-        codec_value cx;
-        cx.type = CODEC_VALUE_ARRAY;
-        cx.v.vArray.len = params.v[0].v.vArray.len;
-        cx.v.vArray.v = (codec_value*)calloc(cx.v.vArray.len, sizeof (codec_value));
         LOG(TRACE, "Get: Request fully received", 0);
         // uint16_t xshd;
         // uint8_t xrk, xk, xshp;
-        if(GET_VIA_ITER) {
-            dbAndIterGuard dbiterg;
-            for(size_t i = 0; i < cx.v.vArray.len; ++i) {
-                auto db = mgr_->ndbForKey(keys[i], serr);
-                if(to_codec_value(serr, out1)) break;
-                auto iter = dbiterg.getIter(db);
-                leveldb::Slice* sv;
-                db->getViaIter(iter, keys[i], sv, serr);
-                if(to_codec_value(serr, out1)) break;
-                to_codec_value(sv, cx.v.vArray.v[i]);
-            }
-        } else {
-            for(size_t i = 0; i < cx.v.vArray.len; ++i) {
-                auto db = mgr_->ndbForKey(keys[i], serr);
-                if(to_codec_value(serr, out1)) break;
-                std::string sv;
-                db->get(keys[i], sv, serr);
-                if(to_codec_value(serr, out1)) break;
-                to_codec_value(sv, cx.v.vArray.v[i]);
-            }
+        // params[1], if a positive int, is a snapshot token to read as of
+        uint64_t snap = (params.len > 1 && params.v[1].type == CODEC_VALUE_POS_INT) ? 
+            params.v[1].v.vUint64 : 0;
+        multiGet(mgr_, pool_, keys, f.values_, serr, snap);
+        if(to_codec_value(serr, out1)) break;
+        // values stay put in f.values_ till the frame is written out, so are referenced in place
+        for(auto& v : f.values_) {
+            appendRow(f.out_, rows, v, true, false);
         }
+        numRows = f.values_.size();
+        rowsOut = true;
     }
     break;
     case 'Q':
@@ -204,22 +701,144 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
         uint8_t lastFilterOp = (uint8_t)params.v[6].v.vUint64;
         size_t offset = params.v[7].v.vUint64;
         size_t limit = params.v[8].v.vUint64;
+        // params[9], if a positive int, streams the rows in responses of up to that many rows
+        size_t chunkRows = (params.len > 9 && params.v[9].type == CODEC_VALUE_POS_INT) ? 
+            params.v[9].v.vUint64 : 0;
+        streamed = chunkRows > 0;
+        // params[10], if bytes, is the cursor to resume from (empty for the first page)
+        if(params.len > 10 && params.v[10].type == CODEC_VALUE_BYTES) {
+            qc.resume = leveldb::Slice(params.v[10].v.vBytes.bytes.v, params.v[10].v.vBytes.bytes.len);
+            cursor = &qc;
+        }
+        // params[11], if a positive int, is the mode flags (see QUERY_ALL_SHARDS)
+        uint64_t mode = (params.len > 11 && params.v[11].type == CODEC_VALUE_POS_INT) ? 
+            params.v[11].v.vUint64 : 0;
+        // params[12], if a positive int, is a snapshot token to read as of
+        uint64_t snap = (params.len > 12 && params.v[12].type == CODEC_VALUE_POS_INT) ? 
+            params.v[12].v.vUint64 : 0;
+        // index dbs are not sharded, so only entity queries go to all shards
+        bool allShards = (mode & QUERY_ALL_SHARDS) && seekpos1.size() > 0 && (seekpos1[0] >> 4) != D_INDEX;
+        if(allShards && cursor != nullptr) {
+            serr = "Invalid input: a query across all shards does not support a cursor";
+            if(to_codec_value(serr, out1)) break;
+        }
         LOG(TRACE, "Query: Request fully received", 0);
         auto db = mgr_->ndbForKey(seekpos1, serr);
         if(to_codec_value(serr, out1)) break;
-        std::vector<leveldb::Slice> sls;
-        auto iterFn = [&] (leveldb::Slice& sl) { sls.push_back(sl); };
-        db->query(seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
-                  lastFilterOp, offset, limit, iterFn, serr);
+        std::shared_ptr<const leveldb::Snapshot> sp;
+        if(snap != 0 && !allShards) sp = mgr_->snapshotFor(db, snap, serr);
         if(to_codec_value(serr, out1)) break;
-        out2.type = CODEC_VALUE_ARRAY;
-        out2.v.vArray.len = sls.size();
-        out2.v.vArray.v = (codec_value*)calloc(out2.v.vArray.len, sizeof (codec_value));
-        for(size_t i = 0; i < sls.size(); ++i) {
-            out2.v.vArray.v[i].type = CODEC_VALUE_BYTES;
-            out2.v.vArray.v[i].v.vBytes.bytes.v = (char*)sls[i].data();
-            out2.v.vArray.v[i].v.vBytes.bytes.len = sls[i].size();
+        if(mode & (QUERY_COUNT | QUERY_EXISTS)) {
+            // the scan just counts keys: no rows (or values) are copied or encoded
+            streamed = false;
+            size_t cap = (mode & QUERY_EXISTS) ? 1 : limit;
+            size_t count = allShards ? 
+                countShards(mgr_, pool_, seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+                            lastFilterOp, offset, cap, snap, serr) :
+                db->query(seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+                          lastFilterOp, offset, cap, [] (leveldb::Slice&) { return true; }, serr,
+                          nullptr, nullptr, sp.get());
+            if(to_codec_value(serr, out1)) break;
+            if(mode & QUERY_EXISTS) {
+                out2.type = CODEC_VALUE_BOOL;
+                out2.v.vBool = count > 0;
+            } else {
+                out2.type = CODEC_VALUE_POS_INT;
+                out2.v.vUint64 = count;
+            }
+            break;
+        }
+        if(streamed && f.flush_) {
+            // the scan lives on the frame, so it can be suspended while the client catches up
+            auto st = std::make_shared<queryStream>();
+            st->db = db;
+            st->snap = sp;
+            st->id = cvOut.v.vArray.v[0];
+            st->chunkRows = chunkRows;
+            st->withCursor = cursor != nullptr;
+            st->cursor.resume = qc.resume;
+            if(allShards) {
+                st->merge = std::make_unique<shardMerge>();
+                st->merge->open(mgr_, pool_, seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+                                lastFilterOp, offset, limit, snap, serr);
+            } else {
+                db->queryOpen(seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, lastFilterOp, 
+                              offset, limit, st->withCursor ? &st->cursor : nullptr, sp.get(), 
+                              st->q, st->iter, serr);
+            }
+            if(to_codec_value(serr, out1)) break;
+            f.stream_ = std::move(st);
+            runStream(f, err);
+            return;
+        }
+        // Rows are written straight into the frame: pinned rows are referenced in place
+        // (the frame keeps the iterator alive), and others are copied into out_.
+        // (Without a way to flush, a streamed query sends all its rows in the final response.)
+        std::shared_ptr<leveldb::Iterator> iter;
+        auto iterFn = [&] (leveldb::Slice& sl) { 
+            // only ask the iterator about rows large enough to reference
+            bool pinned = iter && sl.size() >= IOV_REF_MIN && keyPinned(iter.get());
+            appendRow(f.out_, rows, sl, pinned, false);
+            numRows++;
+            return true;
+        };
+        if(allShards) {
+            // the merged rows are copies, so are not referenced in place
+            queryShards(mgr_, pool_, seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+                        lastFilterOp, offset, limit, iterFn, snap, serr);
+        } else {
+            db->query(seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, 
+                      lastFilterOp, offset, limit, iterFn, serr, &iter, cursor, sp.get());
+        }
+        if(*err != nullptr) return;
+        f.iters_.push_back(iter);
+        if(to_codec_value(serr, out1)) break;
+        rowsOut = true;
+    }
+    break;
+    case 'F':
+    {
+        // query-and-fetch: the params of a query (up to limit), and an optional snapshot token.
+        // The result is [key1, value1, key2, value2, ...], for the entities of the rows found,
+        // leaving out any not found (e.g. deleted since their index row was read).
+        // It is streamed, a batch at a time (see runFetch).
+        if(params.len < 9 || params.v[0].type != CODEC_VALUE_BYTES || params.v[1].type != CODEC_VALUE_BYTES ||
+           params.v[2].type != CODEC_VALUE_POS_INT || params.v[3].type != CODEC_VALUE_POS_INT ||
+           params.v[4].type != CODEC_VALUE_BOOL || params.v[5].type != CODEC_VALUE_BOOL ||
+           params.v[6].type != CODEC_VALUE_POS_INT || params.v[7].type != CODEC_VALUE_POS_INT ||
+           params.v[8].type != CODEC_VALUE_POS_INT) {
+            serr = "Invalid input";
+            if(to_codec_value(serr, out1)) break;
         }
+        streamed = true;
+        leveldb::Slice seekpos1(params.v[0].v.vBytes.bytes.v, params.v[0].v.vBytes.bytes.len);
+        leveldb::Slice seekpos2(params.v[1].v.vBytes.bytes.v, params.v[1].v.vBytes.bytes.len);
+        uint8_t kindid = (uint8_t)params.v[2].v.vUint64;
+        uint8_t shapeid = (uint8_t)params.v[3].v.vUint64;
+        bool ancestorOnly = params.v[4].v.vBool;
+        bool withCursor = params.v[5].v.vBool;
+        uint8_t lastFilterOp = (uint8_t)params.v[6].v.vUint64;
+        size_t offset = params.v[7].v.vUint64;
+        size_t limit = params.v[8].v.vUint64;
+        // params[9], if a positive int, is a snapshot token to read as of
+        uint64_t snap = (params.len > 9 && params.v[9].type == CODEC_VALUE_POS_INT) ? 
+            params.v[9].v.vUint64 : 0;
+        auto db = mgr_->ndbForKey(seekpos1, serr);
+        if(to_codec_value(serr, out1)) break;
+        auto st = std::make_shared<queryStream>();
+        st->fetch = true;
+        st->db = db;
+        st->id = cvOut.v.vArray.v[0];
+        st->snapToken = snap;
+        if(snap != 0) st->snap = mgr_->snapshotFor(db, snap, serr);
+        if(to_codec_value(serr, out1)) break;
+        st->fetches = std::make_unique<TaskGroup>(pool_);
+        db->queryOpen(seekpos1, seekpos2, kindid, shapeid, ancestorOnly, withCursor, lastFilterOp, 
+                      offset, limit, nullptr, st->snap.get(), st->q, st->iter, serr);
+        if(to_codec_value(serr, out1)) break;
+        f.stream_ = std::move(st);
+        runFetch(f, err);
+        return;
     }
     break;
     case 'U':
@@ -251,11 +870,45 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
         if(out1.type != CODEC_VALUE_NIL) break;
         LOG(TRACE, "Update: Request fully received", 0);
 
-        for(auto iter = db2bt.m_.begin(); iter !=db2bt. m_.end(); ++iter) {
-            auto& bt = iter->second;
-            iter->first->update(bt->putkeys, bt->putvalues, bt->delkeys, serr);
+        updateAll(pool_, db2bt, serr);
+        if(to_codec_value(serr, out1)) break;
+    }
+    break;
+    case 'S':
+    {
+        // acquire a snapshot: [ttlMs] => token
+        uint64_t ttlMs = (params.len > 0 && params.v[0].type == CODEC_VALUE_POS_INT) ? params.v[0].v.vUint64 : 0;
+        out2.type = CODEC_VALUE_POS_INT;
+        out2.v.vUint64 = mgr_->acquireSnapshot((uint32_t)std::min(ttlMs, (uint64_t)UINT32_MAX));
+    }
+    break;
+    case 'X':
+    {
+        // release a snapshot: [token]
+        if(params.len < 1 || params.v[0].type != CODEC_VALUE_POS_INT) {
+            serr = "Invalid input";
             if(to_codec_value(serr, out1)) break;
         }
+        mgr_->releaseSnapshot(params.v[0].v.vUint64);
+    }
+    break;
+    case 'M':
+    {
+        // row cache stats: [hits, misses, fills, evictions, invalidations, entries, bytes]
+        RowCacheStats st {};
+        mgr_->rowCacheStats(st);
+        SyncStats ss {};
+        mgr_->syncStats(ss);
+        uint64_t vs[] = { st.hits, st.misses, st.fills, st.evictions, st.invalidations, st.entries, st.bytes,
+                          ss.syncs, ss.errors, ss.lastMicros, ss.maxMicros, ss.lagMicros };
+        size_t n = sizeof(vs) / sizeof(vs[0]);
+        out2.type = CODEC_VALUE_ARRAY;
+        out2.v.vArray.len = n;
+        out2.v.vArray.v = f.arena_.calloc<codec_value>(n);
+        for(size_t i = 0; i < n; i++) {
+            out2.v.vArray.v[i].type = CODEC_VALUE_POS_INT;
+            out2.v.vArray.v[i].v.vUint64 = vs[i];
+        }
     }
     break;
     default:
@@ -267,24 +920,390 @@ void ReqHandler::handle(slice_bytes in, slice_bytes& out, char** err) {
 
     LOG(TRACE, "Response sent to client", 0);
 
-    encoder(&cvOut, &out, err);
-    if(*err != nullptr) return;        
+    if(out1.type != CODEC_VALUE_NIL) {
+        f.out_.bytes.len = 0;
+        f.iters_.clear();
+        numRows = 0;
+        rows.clear();
+        qc.next.clear();
+    }
+    const std::string* next = (cursor == nullptr) ? nullptr : &qc.next;
+    if(streamed) {
+        // the final response of a stream: [id, err, rows, false]
+        writeRowsOut(f, &cvOut.v.vArray.v[0], &out1, numRows, rows, 0, err, next);
+        return;
+    }
+    if(!rowsOut || out1.type != CODEC_VALUE_NIL) {
+        encoder(&cvOut, &f.out_, err);
+        return;
+    }
+    // the result rows are already in the frame: write out the response ahead of them
+    writeRowsOut(f, &cvOut.v.vArray.v[0], &out1, numRows, rows, -1, err, next);
 }
 
-connFdStateMach& ConnHandler::stateFor(int fd) {
-    std::lock_guard<std::mutex> lk(mu_);
-    connFdStateMach* raw;
-    auto it = clientfds_.find(fd);
-    if(it == clientfds_.end()) {
-        auto xx = std::make_unique<connFdStateMach>(fd);
-        raw = xx.get();
-        clientfds_.emplace(fd, std::move(xx));
-        // clientfds_.insert({fd, std::move(xx)});
-        LOG(INFO, "Adding Connection Socket fd: %d", fd);
+// runStream runs (or resumes) the scan of a streamed query, sending its rows out in intermediate
+// responses of up to chunkRows rows (or STREAM_CHUNK_BYTES). Once the connection has too much
+// waiting to be written, the scan is suspended right after a flush, and it returns with
+// f.suspended_ set. The frame is handled again (calling this) once the client catches up,
+// so a slow client never holds up a pool worker. The final response goes out as f.
+void ReqHandler::runStream(reqFrame& f, char** err) {
+    *err = nullptr;
+    auto& st = *f.stream_;
+    std::string serr;
+    codec_value nilv;
+    nilv.type = CODEC_VALUE_NIL;
+    nilv.v.vNil = true;
+    const std::string* chunkCursor = st.withCursor ? &NO_CURSOR : nullptr;
+    std::vector<outSeg> rows;
+    size_t numRows = 0;
+    size_t chunkBytes = 0;
+    auto chunk = std::make_unique<reqFrame>();
+    auto iterFn = [&] (leveldb::Slice& sl) {
+        // pinned rows are referenced in place, as the chunks hold onto the iterator
+        // (merged rows are copies, so are not)
+        bool pinned = st.iter && sl.size() >= IOV_REF_MIN && keyPinned(st.iter.get());
+        appendRow(chunk->out_, rows, sl, pinned, false);
+        numRows++;
+        chunkBytes += sl.size();
+        if(numRows < st.chunkRows && chunkBytes < STREAM_CHUNK_BYTES) return true;
+        // flush the rows so far as [id, nil, rows, true]
+        chunk->id_ = f.id_;
+        chunk->iters_.push_back(st.iter);
+        writeRowsOut(*chunk, &st.id, &nilv, numRows, rows, 1, err, chunkCursor);
+        if(*err != nullptr) return false;
+        numRows = 0;
+        chunkBytes = 0;
+        rows.clear();
+        auto r = f.flush_(std::move(chunk));
+        chunk = std::make_unique<reqFrame>();
+        if(r == FLUSH_CLOSED) serr = "connection closed";
+        else f.suspended_ = (r == FLUSH_WAIT);
+        return r == FLUSH_OK;
+    };
+    bool ended = true;
+    if(st.merge) {
+        leveldb::Slice row;
+        while(st.merge->next(row, serr)) {
+            if(iterFn(row)) continue;
+            ended = !f.suspended_;
+            break;
+        }
     } else {
-        raw = it->second.get();        
+        ended = st.db->queryRun(st.q, iterFn, serr);
+    }
+    if(*err != nullptr) return;
+    if(!ended && f.suspended_) return;
+    f.suspended_ = false;
+    // the final response: [id, err, rows, false], with the rows since the last flush
+    codec_value errv = nilv;
+    if(to_codec_value(serr, errv)) {
+        chunk->out_.bytes.len = 0;
+        numRows = 0;
+        rows.clear();
+        st.cursor.next.clear();
+    }
+    std::swap(f.out_, chunk->out_);
+    f.iters_.push_back(st.iter);
+    writeRowsOut(f, &st.id, &errv, numRows, rows, 0, err, st.withCursor ? &st.cursor.next : nullptr);
+}
+
+// runFetch runs (or resumes) the scan of a query-and-fetch. Each full batch of keys is fetched
+// on the pool while the scan goes on, and is sent out (once the next one is full) in an
+// intermediate response [id, nil, [key1, value1, ...], true]. So at most one batch is in
+// flight, and they go out in order. As with runStream, once the connection has too much waiting
+// to be written, the scan is suspended (right after handing off the next batch), with
+// f.suspended_ set. The last batch goes out in the final response, [id, err, pairs, false].
+// Without a way to flush, all the pairs go out in the final response.
+void ReqHandler::runFetch(reqFrame& f, char** err) {
+    *err = nullptr;
+    auto& st = *f.stream_;
+    std::string serr;
+    codec_value nilv;
+    nilv.type = CODEC_VALUE_NIL;
+    nilv.v.vNil = true;
+    // emit waits for the batch in flight, and sends it out (or keeps it for the final response).
+    // It returns false on an error.
+    auto emit = [&] (bool last) {
+        st.fetches->wait();
+        auto b = std::move(st.inflight);
+        if(!b->err.empty()) serr = b->err;
+        for(auto& s : b->ss) {
+            if(!serr.empty()) break;
+            if(!s.ok() && !s.IsNotFound()) serr = s.ToString();
+        }
+        if(!serr.empty()) return false;
+        if(last || !f.flush_) {
+            st.done.push_back(std::move(b));
+            return true;
+        }
+        auto chunk = std::make_unique<reqFrame>();
+        std::vector<outSeg> rows;
+        size_t numRows = 0;
+        std::vector<std::shared_ptr<fetchBatch>> bs { std::move(b) };
+        appendPairs(*chunk, bs, rows, numRows);
+        chunk->id_ = f.id_;
+        writeRowsOut(*chunk, &st.id, &nilv, numRows, rows, 1, err, nullptr);
+        if(*err != nullptr) return false;
+        auto r = f.flush_(std::move(chunk));
+        if(r == FLUSH_CLOSED) serr = "connection closed";
+        else f.suspended_ = (r == FLUSH_WAIT);
+        return r != FLUSH_CLOSED;
+    };
+    auto iterFn = [&] (leveldb::Slice& sl) {
+        if(!st.batch) {
+            st.batch = std::make_shared<fetchBatch>();
+            st.batch->keys.reserve(FETCH_BATCH);
+        }
+        st.batch->keys.push_back(sl.ToString());
+        if(st.batch->keys.size() < FETCH_BATCH) return true;
+        if(st.inflight && !emit(false)) return false;
+        st.inflight = std::move(st.batch);
+        st.fetches->run([mgr = mgr_, b = st.inflight, snap = st.snapToken] { b->fetch(mgr, snap); });
+        return !f.suspended_;
+    };
+    bool ended = st.db->queryRun(st.q, iterFn, serr);
+    if(*err != nullptr) return;
+    if(!ended && f.suspended_) return;
+    if(serr.empty() && st.batch) {
+        if(st.inflight) emit(false);
+        if(*err != nullptr) return;
+        // the last batch is fetched here, as there is nothing left to overlap it with
+        if(serr.empty()) {
+            st.inflight = std::move(st.batch);
+            st.inflight->fetch(mgr_, st.snapToken);
+        }
+    }
+    if(serr.empty() && st.inflight) emit(true);
+    if(*err != nullptr) return;
+    f.suspended_ = false;
+    // the final response: [id, err, pairs, false], with the batches kept for it
+    auto last = std::make_unique<reqFrame>();
+    std::vector<outSeg> rows;
+    size_t numRows = 0;
+    codec_value errv = nilv;
+    if(!to_codec_value(serr, errv)) appendPairs(*last, st.done, rows, numRows);
+    std::swap(f.out_, last->out_);
+    std::swap(f.values_, last->values_);
+    writeRowsOut(f, &st.id, &errv, numRows, rows, 0, err, nullptr);
+}
+
+// fastReader reads the fields of a fast protocol request in place.
+// Once it runs out of bytes, it fails (and all subsequent reads return zero values).
+class fastReader {
+private:
+    const char* p_;
+    size_t n_;
+    bool ok_ = true;
+public:
+    fastReader(const char* p, size_t n) : p_(p), n_(n) {}
+    bool ok() { return ok_; }
+    bool empty() { return n_ == 0; }
+    const char* take(size_t k) {
+        if(!ok_ || k > n_) {
+            ok_ = false;
+            return nullptr;
+        }
+        auto p = p_;
+        p_ += k;
+        n_ -= k;
+        return p;
+    }
+    uint64_t uint(size_t k) {
+        auto p = (const uint8_t*)take(k);
+        uint64_t v = 0;
+        for(size_t i = 0; p != nullptr && i < k; i++) v = (v << 8) | p[i];
+        return v;
+    }
+    uint8_t u8() { return (uint8_t)uint(1); }
+    uint16_t u16() { return (uint16_t)uint(2); }
+    uint32_t u32() { return (uint32_t)uint(4); }
+    uint64_t u64() { return uint(8); }
+    leveldb::Slice bytes() {
+        auto n = u32();
+        auto p = take(n);
+        return (p == nullptr) ? leveldb::Slice() : leveldb::Slice(p, n);
+    }
+    // count reads a count of items, each at least minSize bytes (so a bad count fails early)
+    uint32_t count(size_t minSize) {
+        auto n = u32();
+        if(n > n_ / minSize) ok_ = false;
+        return ok_ ? n : 0;
+    }
+};
+
+void fastPutUint(slice_bytes* out, uint64_t v, size_t k) {
+    uint8_t b[8];
+    for(size_t i = 0; i < k; i++) b[i] = (uint8_t)(v >> (8*(k-1-i)));
+    ::slice_bytes_append(out, b, k);
+}
+
+void fastPutBytes(slice_bytes* out, const char* v, size_t n) {
+    fastPutUint(out, n, 4);
+    ::slice_bytes_append(out, (void*)v, n);
+}
+
+// decodeFast parses a fast protocol request (see fastproto.h) into f.fr_.
+void ReqHandler::decodeFast(reqFrame& f, char** err) {
+    fastReader rd(f.in_.bytes.v, f.in_.bytes.len);
+    auto& r = f.fr_;
+    f.id_ = rd.u64();
+    r.op = rd.u8();
+    switch(r.op) {
+    case 'G':
+        for(uint32_t i = 0, n = rd.count(4); i < n; i++) r.keys.push_back(rd.bytes());
+        break;
+    case 'N':
+        r.incr = rd.u8() != 0;
+        r.delta = rd.u16();
+        r.initVal = rd.u16();
+        r.key = rd.bytes();
+        break;
+    case 'R':
+        r.count = rd.u32();
+        r.initVal = rd.u64();
+        r.key = rd.bytes();
+        break;
+    case 'Q':
+        r.seekpos1 = rd.bytes();
+        r.seekpos2 = rd.bytes();
+        r.kindid = rd.u8();
+        r.shapeid = rd.u8();
+        r.ancestorOnly = rd.u8() != 0;
+        r.withCursor = rd.u8() != 0;
+        r.lastFilterOp = rd.u8();
+        r.offset = rd.u64();
+        r.limit = rd.u64();
+        // an optional trailing cursor (empty for the first page)
+        r.hasCursor = !rd.empty();
+        if(r.hasCursor) r.cursor = rd.bytes();
+        break;
+    case 'U':
+        for(uint32_t i = 0, n = rd.count(8); i < n; i++) {
+            r.keys.push_back(rd.bytes());
+            r.values.push_back(rd.bytes());
+        }
+        for(uint32_t i = 0, n = rd.count(4); i < n; i++) r.delkeys.push_back(rd.bytes());
+        break;
     }
-    return *raw;
+    // an unknown op is reported in the response (by handleFast)
+    if(!rd.ok()) *err = (char*)&("Invalid fast protocol request: too short for its op"[0]);
+}
+
+// handleFast runs a fast protocol request, writing its response straight into the frame.
+// As in handle, pinned query rows are referenced in place.
+void ReqHandler::handleFast(reqFrame& f, char** err) {
+    *err = nullptr;
+    auto& r = f.fr_;
+    auto& out = f.out_;
+    std::string serr;
+    // the result, laid out against out_ (and pinned rows)
+    std::vector<outSeg> res;
+    size_t off = out.bytes.len;
+    switch(r.op) {
+    case 'N':
+    {
+        auto db = mgr_->ndbForKey(r.key, serr);
+        if(!serr.empty()) break;
+        uint64_t nextval;
+        db->incrdecr(r.key, r.incr, r.delta, (uint16_t)r.initVal, &nextval, serr);
+        if(!serr.empty()) break;
+        fastPutUint(&out, nextval, 8);
+        appendSeg(res, outSeg{nullptr, off, 8});
+    }
+    break;
+    case 'R':
+    {
+        auto db = mgr_->ndbForKey(r.key, serr);
+        if(!serr.empty()) break;
+        uint64_t start, end;
+        db->reserve(r.key, r.count, r.initVal, &start, &end, serr);
+        if(!serr.empty()) break;
+        fastPutUint(&out, start, 8);
+        fastPutUint(&out, end, 8);
+        appendSeg(res, outSeg{nullptr, off, 16});
+    }
+    break;
+    case 'G':
+    {
+        multiGet(mgr_, pool_, r.keys, f.values_, serr);
+        if(!serr.empty()) break;
+        fastPutUint(&out, r.keys.size(), 4);
+        appendSeg(res, outSeg{nullptr, off, 4});
+        for(auto& v : f.values_) appendRow(out, res, v, true, true);
+    }
+    break;
+    case 'Q':
+    {
+        auto db = mgr_->ndbForKey(r.seekpos1, serr);
+        if(!serr.empty()) break;
+        fastPutUint(&out, 0, 4); // number of rows, filled in below
+        appendSeg(res, outSeg{nullptr, off, 4});
+        uint32_t numRows = 0;
+        std::shared_ptr<leveldb::Iterator> iter;
+        auto iterFn = [&] (leveldb::Slice& sl) {
+            appendRow(out, res, sl, sl.size() >= IOV_REF_MIN && keyPinned(iter.get()), true);
+            numRows++;
+            return true;
+        };
+        queryCursor qc;
+        qc.resume = r.cursor;
+        db->query(r.seekpos1, r.seekpos2, r.kindid, r.shapeid, r.ancestorOnly, r.withCursor, 
+                  r.lastFilterOp, r.offset, r.limit, iterFn, serr, &iter, r.hasCursor ? &qc : nullptr);
+        f.iters_.push_back(iter);
+        for(int i = 0; i < 4; i++) out.bytes.v[off+i] = (char)(numRows >> (8*(3-i)));
+        if(r.hasCursor) {
+            size_t off2 = out.bytes.len;
+            fastPutBytes(&out, qc.next.data(), qc.next.size());
+            appendSeg(res, outSeg{nullptr, off2, out.bytes.len - off2});
+        }
+    }
+    break;
+    case 'U':
+    {
+        db2BatchUpdateT db2bt;
+        for(size_t i = 0; i < r.keys.size(); ++i) {
+            auto db = mgr_->ndbForKey(r.keys[i], serr);
+            if(!serr.empty()) break;
+            auto bt = db2bt.getT(db);
+            bt->putkeys.push_back(r.keys[i]);
+            bt->putvalues.push_back(r.values[i]);
+        }
+        for(size_t i = 0; serr.empty() && i < r.delkeys.size(); ++i) {
+            auto db = mgr_->ndbForKey(r.delkeys[i], serr);
+            if(!serr.empty()) break;
+            db2bt.getT(db)->delkeys.push_back(r.delkeys[i]);
+        }
+        if(serr.empty()) updateAll(pool_, db2bt, serr);
+    }
+    break;
+    default:
+        char errbuf[64];
+        snprintf(errbuf, 64, "Invalid fast protocol op: 0x%x", r.op);
+        serr = errbuf;
+    }
+    if(!serr.empty()) {
+        res.clear();
+        f.iters_.clear();
+    }
+    size_t reslen = 0;
+    for(auto& sg : res) reslen += sg.len;
+    // the response head goes out ahead of the result
+    off = out.bytes.len;
+    fastPutUint(&out, 8 + 4 + serr.size() + reslen, 4);
+    fastPutUint(&out, f.id_, 8);
+    fastPutBytes(&out, serr.data(), serr.size());
+    f.segs_.push_back(outSeg{nullptr, off, out.bytes.len - off});
+    f.segs_.insert(f.segs_.end(), res.begin(), res.end());
+}
+
+std::shared_ptr<connFdStateMach> ConnHandler::stateFor(int fd) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = clientfds_.find(fd);
+    if(it != clientfds_.end()) return it->second;
+    auto xx = std::make_shared<connFdStateMach>(fd);
+    clientfds_.emplace(fd, xx);
+    LOG(INFO, "Adding Connection Socket fd: %d", fd);
+    return xx;
 }
 
 void ConnHandler::unregisterFd(int fd, std::string& err) {
@@ -292,126 +1311,407 @@ void ConnHandler::unregisterFd(int fd, std::string& err) {
     auto it = clientfds_.find(fd);
     if(it != clientfds_.end()) {
         LOG(INFO, "Removing socket fd: %d", fd);
+        {
+            std::lock_guard<std::mutex> lk2(it->second->mu_);
+            it->second->close();
+        }
         clientfds_.erase(it);
     }
 }
 
+void ConnHandler::stopFds() {
+    std::lock_guard<std::mutex> lk(mu_);
+    for(auto& e : clientfds_) {
+        std::lock_guard<std::mutex> lk2(e.second->mu_);
+        e.second->close();
+    }
+    clientfds_.clear();
+}
+
 void ConnHandler::handleFd(int fd, std::string& err) {
-    auto& h = stateFor(fd);
-    // h is either waiting, reading, processing, writing
-    std::lock_guard<std::mutex> lk(h.mu_);
-    switch(h.state_) {
-    case ugorji::conn::CONN_READY:           
-        doStartFd(h, err);
-        break;
-    case ugorji::conn::CONN_READING:
-        doReadFd(h, err);
-        break;
-    case ugorji::conn::CONN_PROCESSING:
-        doProcessFd(h, err);
-        break;
-    case ugorji::conn::CONN_WRITING:
-        doWriteFd(h, err);
+    auto h = stateFor(fd);
+    std::lock_guard<std::mutex> lk(h->mu_);
+    // an error from running a request on the pool is reported on the next event for the fd
+    if(!h->err_.empty()) {
+        err = h->err_;
+        return;
     }
+    serviceFd(*h, err);
 }
 
-void ConnHandler::doStartFd(connFdStateMach& x, std::string& err) {
-    auto fd = x.fd_;
-    x.reinit();
+// serviceFd releases the frames whose zerocopy sends have completed, writes out responses
+// left over from a short write, then reads and processes as many frames as are available
+// (up to our pipeline limit).
+// It must be called with x.mu_ held.
+void ConnHandler::serviceFd(connFdStateMach& x, std::string& err) {
+    x.paused_ = false;
+    reapZerocopy(x);
+    doWriteFd(x, err);
+    if(err.empty()) doReadFd(x, err);
+    // if we stopped at the limit, resume once a response is written out (see readyFd)
+    x.paused_ = err.empty() && x.pending() >= MAX_PIPELINED_FRAMES;
+}
 
-    while(true) {
-        uint8_t arr[8];
-        int n2 = ::read(fd, arr, 8);
-        if(n2 <= 0) { // if n2 == 0, EOF (which is an error as we expect something)
-            if(errno == EINTR) continue;
-            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
-            snprintf(errbuf_, 128, "read returned %d, with errno: %s", n2, ugorji::conn::errnoStr().c_str());
-            err = errbuf_;
-            x.reinit();
-            return;            
-        }
-        
-        auto numBytesForLen = arr[0];
-        if(numBytesForLen > 7) {
-            snprintf(errbuf_, 128, "expect up to 7 bytes for reading length, but received %d", numBytesForLen);
-            err = errbuf_;
-            return;
-        }
+// doStartFd parses the next frame header out of the receive buffer, and moves as much
+// of the frame as is buffered into a new reqFrame (presized to the request length).
+// It returns true if a full frame was consumed (and processed).
+// 
+// The header is 1 byte denoting how many bytes (up to 7) hold the big-endian request length,
+// followed by those bytes.
+bool ConnHandler::doStartFd(connFdStateMach& x, std::string& err) {
+    auto& rb = x.rbuf_.bytes;
+    size_t avail = rb.len - x.rpos_;
+    if(avail == 0) return false;
+    auto hdr = (uint8_t*)&rb.v[x.rpos_];
+    auto numBytesForLen = hdr[0];
+    if(numBytesForLen == FAST_PROTO_HELLO) {
+        // client opts into the fast protocol: acknowledge it ahead of any responses
+        x.rpos_++;
+        x.fast_ = true;
+        auto ack = x.newFrame();
+        ::slice_bytes_append_1(&ack->out_, FAST_PROTO_HELLO);
+        ack->prepare();
+        x.outbytes_ += ack->outlen_;
+        x.outq_.push_back(std::move(ack));
+        readyFd(x, err);
+        return err.empty();
+    }
+    if(numBytesForLen > 7) {
+        char errbuf[128];
+        snprintf(errbuf, 128, "expect up to 7 bytes for reading length, but received %d", numBytesForLen);
+        err = errbuf;
+        return false;
+    }
+    if(avail < (size_t)(numBytesForLen) + 1) return false;
+    uint8_t arr[8] {};
+    memcpy(&arr[8-numBytesForLen], &hdr[1], numBytesForLen);
+    x.reqlen_ = util_big_endian_read_uint64(arr);
+    if(x.reqlen_ > MAX_REQ_LEN) {
+        char errbuf[128];
+        snprintf(errbuf, 128, "request length: %llu exceeds max: %llu", 
+                 (unsigned long long)x.reqlen_, (unsigned long long)MAX_REQ_LEN);
+        err = errbuf;
+        return false;
+    }
+    x.rpos_ += numBytesForLen + 1;
+    avail -= numBytesForLen + 1;
 
-        n2 = numBytesForLen+1;
-        if(n2 < 8) {
-            ::slice_bytes_expand(&x.in_, 8-n2);
-            memcpy(&x.in_.bytes.v[0], &arr[n2], 8-n2);
-            x.in_.bytes.len = 8-n2;
-            memmove(&arr[8-n2], &arr[0], n2);
-            for(int i = 0; i < (8-n2); i++) {
-                arr[i] = 0;
-            }
-        }
-        
-        x.reqlen_ = util_big_endian_read_uint64(arr);
+    x.rd_ = x.newFrame();
+    auto& in = x.rd_->in_;
+    ::slice_bytes_expand(&in, x.reqlen_);
+    size_t n = (avail < x.reqlen_) ? avail : x.reqlen_;
+    memcpy(in.bytes.v, &rb.v[x.rpos_], n);
+    in.bytes.len = n;
+    x.rpos_ += n;
+    if(n < x.reqlen_) {
         x.state_ = ugorji::conn::CONN_READING;
-        doReadFd(x, err);
+        return false;
+    }
+    x.state_ = ugorji::conn::CONN_PROCESSING;
+    doProcessFd(x, err);
+    return true;
+}
+
+// parseFd processes the frames already in the receive buffer, up to our pipeline limit.
+void ConnHandler::parseFd(connFdStateMach& x, std::string& err) {
+    while(err.empty() && x.pending() < MAX_PIPELINED_FRAMES &&
+          x.state_ == ugorji::conn::CONN_READY && doStartFd(x, err)) { }
+}
+
+// readIovFd sets up iov for the next read off the socket, returning the number of iovecs.
+// If we are in the middle of a frame, the rest of it is read straight into the frame's buffer,
+// and anything after it (e.g. pipelined frames) goes into the receive buffer.
+int ConnHandler::readIovFd(connFdStateMach& x, struct iovec* iov) {
+    auto& rb = x.rbuf_;
+    // move any partial header to the front, and ensure we have room to read into
+    if(x.rpos_ > 0) {
+        rb.bytes.len -= x.rpos_;
+        if(rb.bytes.len > 0) memmove(rb.bytes.v, &rb.bytes.v[x.rpos_], rb.bytes.len);
+        x.rpos_ = 0;
+    }
+    if(rb.cap < RECV_BUF_SIZE) ::slice_bytes_expand(&rb, RECV_BUF_SIZE - rb.bytes.len);
+    int niov = 0;
+    if(x.state_ == ugorji::conn::CONN_READING) {
+        auto& in = x.rd_->in_;
+        iov[niov++] = { &in.bytes.v[in.bytes.len], x.reqlen_ - in.bytes.len };
+    }
+    iov[niov++] = { &rb.bytes.v[rb.bytes.len], rb.cap - rb.bytes.len };
+    return niov;
+}
+
+// readDoneFd accounts for n bytes read into iov (as set up by readIovFd),
+// and processes the frames which are now complete.
+void ConnHandler::readDoneFd(connFdStateMach& x, struct iovec* iov, int niov, size_t n, std::string& err) {
+    // the state must not have changed since readIovFd laid out iov (e.g. across an async read)
+    if(niov != (x.state_ == ugorji::conn::CONN_READING ? 2 : 1)) {
+        err = "read into " + std::to_string(niov) + " iovecs, which do not match the connection state";
         return;
     }
-    return;
+    if(x.state_ == ugorji::conn::CONN_READING) {
+        auto& in = x.rd_->in_;
+        size_t n3 = (n < iov[0].iov_len) ? n : iov[0].iov_len;
+        in.bytes.len += n3;
+        n -= n3;
+    }
+    x.rbuf_.bytes.len += n;
+    if(x.state_ == ugorji::conn::CONN_READING && x.rd_->in_.bytes.len == x.reqlen_) {
+        x.state_ = ugorji::conn::CONN_PROCESSING;
+        doProcessFd(x, err);
+    }
+    parseFd(x, err);
 }
 
+// doReadFd drains the socket with one large readv per pass (see readIovFd).
 void ConnHandler::doReadFd(connFdStateMach& x, std::string& err) {
     auto fd = x.fd_;
     LOG(TRACE, "<conn-hdlr>: reading fd: %d", fd);
-    while(x.reqlen_ > x.in_.bytes.len) {
-        size_t n2 = x.reqlen_ - x.in_.bytes.len;
-        if(n2 > FD_BUF_INCR) n2 = FD_BUF_INCR;
-        ::slice_bytes_expand(&x.in_, n2);
-        n2 = ::read(fd, &x.in_.bytes.v[x.in_.bytes.len], n2);
-        if(n2 > 0) {
-            x.in_.bytes.len += n2;
-            continue;
+    parseFd(x, err);
+    while(err.empty() && x.pending() < MAX_PIPELINED_FRAMES) {
+        struct iovec iov[2];
+        int niov = readIovFd(x, iov);
+        size_t want = iov[0].iov_len + (niov > 1 ? iov[1].iov_len : 0);
+        ssize_t n2 = ::readv(fd, iov, niov);
+        if(n2 <= 0) { // if n2 == 0, EOF (which is an error as we expect something)
+            if(n2 < 0 && errno == EINTR) continue;
+            if(n2 < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            char errbuf[128];
+            snprintf(errbuf, 128, "read returned %ld, with errno: %s", n2, ugorji::conn::errnoStr().c_str());
+            err = errbuf;
+            x.reinit();
+            return;
         }
-        if(n2 == 0) return; // EOF
-        if(errno == EINTR) continue;
-        if(errno == EAGAIN || errno == EWOULDBLOCK) return;
-        snprintf(errbuf_, 128, "read returned %lu, with errno: %s", n2, ugorji::conn::errnoStr().c_str());
-        err = errbuf_;
-        x.reinit();
-        return;
+        readDoneFd(x, iov, niov, n2, err);
+        // a short read means the socket has been drained
+        if((size_t)n2 < want) return;
     }
-
-    x.state_ = ugorji::conn::CONN_PROCESSING;
-    doProcessFd(x, err);
 }
 
 void ConnHandler::doProcessFd(connFdStateMach& x, std::string& err) {
     char* cerr = nullptr;
-    reqHdlr_->handle(x.in_, x.out_, &cerr);
+    auto f = std::move(x.rd_);
+    x.reinit();
+    f->fast_ = x.fast_;
+    reqHdlr_->decode(*f, &cerr);
     if(cerr != nullptr) {
         err = cerr;
-        x.reinit();
         return;
     }
-    x.state_ = ugorji::conn::CONN_WRITING;
-    doWriteFd(x, err);
+    auto id = f->id_;
+    if(x.inflight_.find(id) != x.inflight_.end()) {
+        char errbuf[128];
+        snprintf(errbuf, 128, "request id: %llu is already in flight", (unsigned long long)id);
+        err = errbuf;
+        return;
+    }
+    auto& g = *f;
+    x.inflight_.emplace(id, std::move(f));
+    if(pool_ != nullptr) {
+        // streaming needs the pool, as a suspended stream is resumed on it (see resumeFd).
+        // Inline, a streamed result goes out as a single response.
+        // Note: x outlives the frame, and the pool holds a reference to x while running it.
+        g.flush_ = [this, &x] (std::unique_ptr<reqFrame> c) { return streamFd(x, std::move(c)); };
+        pool_->submit([this, sx = x.shared_from_this(), &g] { runFd(sx, g); });
+        return;
+    }
+    reqHdlr_->handle(g, &cerr);
+    if(cerr != nullptr) {
+        err = cerr;
+        x.inflight_.erase(id);
+        return;
+    }
+    completeFd(x, id, err);
 }
 
+// runFd runs a request on the execution pool, and hands the response back to the connection.
+// A suspended stream is parked on the connection instead, till the client catches up.
+// 
+// There is no caller to hand errors to, so we keep it on the connection and shutdown the socket.
+// The subsequent event on the fd will report the error (and have the connection closed).
+void ConnHandler::runFd(std::shared_ptr<connFdStateMach> sx, reqFrame& f) {
+    char* cerr = nullptr;
+    reqHdlr_->handle(f, &cerr);
+    auto& x = *sx;
+    std::lock_guard<std::mutex> lk(x.mu_);
+    if(x.closed_) return;
+    std::string err;
+    if(cerr != nullptr) {
+        err = cerr;
+        x.inflight_.erase(f.id_);
+    } else if(f.suspended_) {
+        x.parked_.push_back(&f);
+        // it may have drained since the stream was suspended
+        if(x.outbytes_ < MAX_STREAM_BUFFERED) resumeFd(x);
+    } else {
+        completeFd(x, f.id_, err);
+    }
+    if(!err.empty() && x.err_.empty()) {
+        LOG(ERROR, "<conn-hdlr>: fd: %d, error: %s", x.fd_, err.c_str());
+        x.err_ = err;
+        ::shutdown(x.fd_, SHUT_RDWR);
+    }
+}
+
+// completeFd queues up the response for the in-flight request with this id, and writes it out.
+// It must be called with x.mu_ held.
+void ConnHandler::completeFd(connFdStateMach& x, uint64_t id, std::string& err) {
+    auto it = x.inflight_.find(id);
+    if(it == x.inflight_.end()) return;
+    it->second->prepare();
+    x.outbytes_ += it->second->outlen_;
+    x.outq_.push_back(std::move(it->second));
+    x.inflight_.erase(it);
+    readyFd(x, err);
+}
+
+// streamFd queues up an intermediate response of a streamed result, and writes it out.
+// It never waits: if too much is waiting to be written, it says to suspend the stream
+// (see runStream), so a large result streams through a bounded amount of memory.
+flushResult ConnHandler::streamFd(connFdStateMach& x, std::unique_ptr<reqFrame> c) {
+    std::lock_guard<std::mutex> lk(x.mu_);
+    if(x.closed_ || !x.err_.empty()) return FLUSH_CLOSED;
+    c->prepare();
+    x.outbytes_ += c->outlen_;
+    x.outq_.push_back(std::move(c));
+    std::string err;
+    readyFd(x, err);
+    if(!err.empty()) {
+        LOG(ERROR, "<conn-hdlr>: fd: %d, error: %s", x.fd_, err.c_str());
+        x.err_ = err;
+        ::shutdown(x.fd_, SHUT_RDWR);
+        return FLUSH_CLOSED;
+    }
+    return (x.outbytes_ < MAX_STREAM_BUFFERED) ? FLUSH_OK : FLUSH_WAIT;
+}
+
+// resumeFd runs the parked streams of a connection again, on the pool.
+// It must be called with x.mu_ held.
+void ConnHandler::resumeFd(connFdStateMach& x) {
+    for(auto f : x.parked_) {
+        f->suspended_ = false;
+        pool_->submit([this, sx = x.shared_from_this(), f] { runFd(sx, *f); });
+    }
+    x.parked_.clear();
+}
+
+// readyFd is called when a response is queued up. We write it out,
+// and resume reading if we had stopped at the pipeline limit.
+// It must be called with x.mu_ held.
+void ConnHandler::readyFd(connFdStateMach& x, std::string& err) {
+    if(x.paused_) serviceFd(x, err);
+    else doWriteFd(x, err);
+}
+
+bool ConnHandler::enableZerocopy(connFdStateMach& x) {
+    if(x.zerocopy_ == 0) {
+        int one = 1;
+        x.zerocopy_ = (::setsockopt(x.fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) ? 1 : -1;
+        if(x.zerocopy_ == -1) {
+            LOG(WARNING, "<conn-hdlr>: fd: %d, cannot enable SO_ZEROCOPY: %s", 
+                x.fd_, ugorji::conn::errnoStr().c_str());
+        }
+    }
+    return x.zerocopy_ == 1;
+}
+
+// reapZerocopy reads the completion notifications for MSG_ZEROCOPY sends off the socket
+// error queue, and releases the frames which the kernel is done with.
+void ConnHandler::reapZerocopy(connFdStateMach& x) {
+    while(!x.zcq_.empty()) {
+        char ctrl[128];
+        struct msghdr msg {};
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        if(::recvmsg(x.fd_, &msg, MSG_ERRQUEUE) < 0) return; // nothing (more) to reap
+        for(auto cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            auto ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // notifications cover the range of sends [ee_info, ee_data]
+            if((int32_t)(ee->ee_data + 1 - x.zcdone_) > 0) x.zcdone_ = ee->ee_data + 1;
+        }
+        while(!x.zcq_.empty() && (int32_t)(x.zcq_.front()->zcseq_ - x.zcdone_) < 0) {
+            x.release(std::move(x.zcq_.front()));
+            x.zcq_.pop_front();
+        }
+    }
+}
+
+// writeIovFd points iov at the iovecs left to write out for the response at the front
+// of the queue, returning how many there are (0 if there is nothing to write).
+int ConnHandler::writeIovFd(connFdStateMach& x, struct iovec** iov) {
+    while(!x.outq_.empty()) {
+        auto& f = *x.outq_.front();
+        if(f.iovpos_ == f.iov_.size()) {
+            x.release(std::move(x.outq_.front()));
+            x.outq_.pop_front();
+            continue;
+        }
+        *iov = &f.iov_[f.iovpos_];
+        size_t niov = f.iov_.size() - f.iovpos_;
+        return (niov > IOV_MAX) ? IOV_MAX : (int)niov;
+    }
+    return 0;
+}
+
+// wroteFd accounts for n bytes written off the response at the front of the queue,
+// releasing it once fully written (or holding it till the kernel is done, if sent zerocopy).
+void ConnHandler::wroteFd(connFdStateMach& x, size_t n, bool zc) {
+    auto& f = *x.outq_.front();
+    x.outbytes_ -= n;
+    if(x.outbytes_ < MAX_STREAM_BUFFERED && !x.parked_.empty()) resumeFd(x);
+    if(zc) {
+        f.zerocopy_ = true;
+        f.zcseq_ = x.zcsent_++;
+    }
+    for(; f.iovpos_ < f.iov_.size() && n >= f.iov_[f.iovpos_].iov_len; f.iovpos_++) {
+        n -= f.iov_[f.iovpos_].iov_len;
+    }
+    if(n > 0) {
+        auto& v = f.iov_[f.iovpos_];
+        v.iov_base = (char*)v.iov_base + n;
+        v.iov_len -= n;
+    }
+    if(f.iovpos_ < f.iov_.size()) return;
+    if(f.zerocopy_) x.zcq_.push_back(std::move(x.outq_.front()));
+    else x.release(std::move(x.outq_.front()));
+    x.outq_.pop_front();
+}
+
+// doWriteFd writes out the queued responses, with one writev per pass over a frame's iovecs.
+// Large responses are sent with MSG_ZEROCOPY if configured.
 void ConnHandler::doWriteFd(connFdStateMach& x, std::string& err) {
     auto fd = x.fd_;
-    LOG(TRACE, "<conn-hdlr>: writing fd: %d", fd);
-    while(x.cursor_ < x.out_.bytes.len) {
-        int n2 = ::write(fd, &x.out_.bytes.v[x.cursor_], x.out_.bytes.len-x.cursor_);
+    reapZerocopy(x);
+    struct iovec* iov;
+    int niov;
+    while((niov = writeIovFd(x, &iov)) > 0) {
+        LOG(TRACE, "<conn-hdlr>: writing fd: %d", fd);
+        bool zc = zerocopyMin_ > 0 && x.outq_.front()->outlen_ >= zerocopyMin_ && enableZerocopy(x);
+        ssize_t n2;
+        if(zc) {
+            struct msghdr msg {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = niov;
+            n2 = ::sendmsg(fd, &msg, MSG_ZEROCOPY);
+            // if out of optmem for pinning pages, copy instead
+            if(n2 < 0 && errno == ENOBUFS) {
+                zc = false;
+                n2 = ::writev(fd, iov, niov);
+            }
+        } else {
+            n2 = ::writev(fd, iov, niov);
+        }
         if(n2 < 0) {
             if(errno == EINTR) continue;
             if(errno == EAGAIN || errno == EWOULDBLOCK) return;
-            snprintf(errbuf_, 128, "write returned %d, with errno: %s", n2, ugorji::conn::errnoStr().c_str());
-            err = errbuf_;
-            x.reinit();
+            char errbuf[128];
+            snprintf(errbuf, 128, "write returned %ld, with errno: %s", n2, ugorji::conn::errnoStr().c_str());
+            err = errbuf;
+            x.outq_.clear();
             return;
         }
-        x.cursor_ += n2;
+        wroteFd(x, n2, zc);
     }
-    x.reinit();
 }
 
 } //close namespace ndb
 } // close namespace ugorji
-
@@ -1,69 +1,277 @@
 #pragma once
 
+#include <deque>
+#include <sys/uio.h>
 #include <ugorji/conn/conn.h>
+#include <ugorji/codec/codec.h>
 
 #include "manager.h"
+#include "pool.h"
+#include "arena.h"
+#include "fastproto.h"
 
 namespace ugorji { 
 namespace ndb { 
 
-class connFdStateMach {
+// size of the per-connection receive buffer, which we drain the socket into.
+const size_t RECV_BUF_SIZE = 64 << 10;
+
+// max number of frames per connection which are in flight or waiting to be written.
+// We stop reading off the connection once we get here, till the client drains its responses.
+const size_t MAX_PIPELINED_FRAMES = 64;
+
+// number of written out frames a connection keeps around for reuse,
+// and the largest in/out buffer such a frame holds on to.
+const size_t MAX_SPARE_FRAMES = 8;
+const size_t MAX_SPARE_BUF = 1 << 20;
+
+// binc descriptors, for the parts of a response which we write out directly (see bincWriteLen).
+// These must match codec_binc_encode.
+const uint8_t BINC_VD_STRING = 4;
+const uint8_t BINC_VD_BYTES = 5;
+const uint8_t BINC_VD_ARRAY = 6;
+
+void bincWriteLen(slice_bytes* out, uint8_t vd, uint64_t n);
+
+// flushResult is what flushing an intermediate response of a streamed result (see reqFrame::flush_) says.
+enum flushResult {
+    FLUSH_OK,     // queued up
+    FLUSH_WAIT,   // queued up, but the connection has enough waiting to be written: suspend the stream
+    FLUSH_CLOSED  // the connection is gone
+};
+
+// queryStream is the scan of a streamed result, kept across suspensions (see ReqHandler::runStream).
+class queryStream;
+
+// outSeg is a part of a response: either len bytes at off in out_, or len bytes at ext
+// (which are referenced in place, and kept alive by the frame till it is written out).
+struct outSeg {
+    const char* ext;
+    size_t off;
+    size_t len;
+};
+
+// freeCodecValue frees what the decoder allocated for a value: the bytes of its strings
+// and bytes values, and its arrays (recursively). v is left nil.
+inline void freeCodecValue(codec_value& v) {
+    switch(v.type) {
+    case CODEC_VALUE_STRING:
+        free(v.v.vString.bytes.v);
+        break;
+    case CODEC_VALUE_BYTES:
+        free(v.v.vBytes.bytes.v);
+        break;
+    case CODEC_VALUE_ARRAY:
+        for(size_t i = 0; i < v.v.vArray.len; i++) freeCodecValue(v.v.vArray.v[i]);
+        free(v.v.vArray.v);
+        break;
+    default:
+        break;
+    }
+    v = codec_value {};
+}
+
+// reqFrame is a single request read off a connection, along with its encoded response.
+class reqFrame {
+public:
+    uint64_t id_;
+    slice_bytes in_ {};
+    slice_bytes out_ {};
+    codec_value cvIn_ {};
+    // segs_ lays out the response. If empty, the response is all of out_.
+    std::vector<outSeg> segs_;
+    std::vector<struct iovec> iov_;
+    size_t iovpos_ = 0;
+    size_t outlen_ = 0;
+    bool zerocopy_ = false;
+    uint32_t zcseq_ = 0;
+    // values_ pins the values looked up by a get, till the response is encoded
+    std::vector<leveldb::PinnableSlice> values_;
+    // iterators whose pinned rows are referenced in segs_ (shared with earlier chunks of a stream)
+    std::vector<std::shared_ptr<leveldb::Iterator>> iters_;
+    // flush_, if set, queues up an intermediate response of a streamed result ahead of
+    // this (final) one. It never blocks: if the client is behind, it says to suspend.
+    std::function<flushResult (std::unique_ptr<reqFrame>)> flush_;
+    // stream_ is the scan of a streamed result. If suspended_, the frame is parked on its connection
+    // (still in flight) till the client catches up, and then handled again to resume it.
+    std::shared_ptr<queryStream> stream_;
+    bool suspended_ = false;
+    // arena_ holds the allocations made while handling the request (e.g. the response values)
+    Arena arena_;
+    // fast_ marks a request in the fast protocol (see fastproto.h), which is parsed into fr_
+    bool fast_ = false;
+    fastReq fr_;
+    reqFrame() : id_(0) {}
+    ~reqFrame() {
+        free(in_.bytes.v);
+        free(out_.bytes.v);
+        freeCodecValue(cvIn_);
+    }
+    // reset readies the frame for reuse by another request, keeping its buffers
+    // (unless too large) and its arena's first block.
+    void reset() {
+        id_ = 0;
+        resetBuf(in_);
+        resetBuf(out_);
+        freeCodecValue(cvIn_);
+        segs_.clear();
+        iov_.clear();
+        iovpos_ = 0;
+        outlen_ = 0;
+        zerocopy_ = false;
+        zcseq_ = 0;
+        values_.clear();
+        iters_.clear();
+        flush_ = nullptr;
+        stream_.reset();
+        suspended_ = false;
+        arena_.reset();
+        fast_ = false;
+        fr_.reset();
+    }
+    static void resetBuf(slice_bytes& b) {
+        b.bytes.len = 0;
+        if(b.cap <= MAX_SPARE_BUF) return;
+        free(b.bytes.v);
+        b = slice_bytes {};
+    }
+    // prepare lays out the response as iovecs, for writing out
+    void prepare() {
+        if(segs_.empty()) segs_.push_back(outSeg{nullptr, 0, out_.bytes.len});
+        iov_.reserve(segs_.size());
+        for(auto& sg : segs_) {
+            if(sg.len == 0) continue;
+            iov_.push_back({ (void*)(sg.ext != nullptr ? sg.ext : &out_.bytes.v[sg.off]), sg.len });
+            outlen_ += sg.len;
+        }
+    }
+};
+
+// connFdStateMach tracks a connection. Requests are pipelined: we keep reading frames
+// while earlier ones are still in flight, and write responses back in the order they complete.
+// The client matches responses to requests using the request id.
+// 
+// Requests are run on the execution pool, which holds a reference to the connFdStateMach
+// till it is done. closed_ tells it that the fd was unregistered (and may have been reused).
+class connFdStateMach : public std::enable_shared_from_this<connFdStateMach> {
 public:
     std::mutex mu_;
-    slice_bytes in_;
-    slice_bytes out_;
     int fd_;
+    bool closed_ = false;
+    bool paused_ = false;
+    bool fast_ = false; // client opted into the fast protocol
+    std::string err_;
+    size_t outbytes_ = 0; // bytes queued up to be written
+    // parked_ are the in-flight frames of suspended streams, which are resumed (on the pool)
+    // once outbytes_ drops low enough (see ConnHandler::resumeFd).
+    std::vector<reqFrame*> parked_;
+    slice_bytes rbuf_ {};
+    bool rbufFixed_ = false; // rbuf_ is RECV_BUF_SIZE bytes owned by the engine (not us)
+    size_t rpos_ = 0;
     size_t reqlen_;
-    size_t cursor_;
+    std::unique_ptr<reqFrame> rd_;
+    std::unordered_map<uint64_t, std::unique_ptr<reqFrame>> inflight_;
+    std::deque<std::unique_ptr<reqFrame>> outq_;
+    // frames sent with MSG_ZEROCOPY, held till the kernel says it is done with their bytes
+    std::deque<std::unique_ptr<reqFrame>> zcq_;
+    int zerocopy_ = 0; // 1 if SO_ZEROCOPY is enabled on the socket, -1 if it could not be
+    uint32_t zcsent_ = 0;
+    uint32_t zcdone_ = 0;
     ugorji::conn::ConnState state_;
     explicit connFdStateMach(int fd) : fd_(fd) { reinit(); };
-    ~connFdStateMach() {};
+    ~connFdStateMach() { if(!rbufFixed_) free(rbuf_.bytes.v); };
+    // pending is the number of frames in the pipeline (in flight, or being written out).
+    // Frames only waiting on zerocopy completions are not counted, as those are reaped
+    // on the next event for the fd (see serviceFd), which a paused read must not wait on.
+    size_t pending() { return inflight_.size() + outq_.size(); }
+    // spare_ holds written out frames, for reuse by subsequent requests (see newFrame/release)
+    std::vector<std::unique_ptr<reqFrame>> spare_;
+    // newFrame returns a frame for the next request. It must be called with mu_ held.
+    std::unique_ptr<reqFrame> newFrame() {
+        if(spare_.empty()) return std::make_unique<reqFrame>();
+        auto f = std::move(spare_.back());
+        spare_.pop_back();
+        return f;
+    }
+    // release takes back a frame once its response is written out. It must be called with mu_ held.
+    void release(std::unique_ptr<reqFrame> f) {
+        if(spare_.size() >= MAX_SPARE_FRAMES) return;
+        f->reset();
+        spare_.push_back(std::move(f));
+    }
+    // close marks the connection as closed, so requests still running drop their responses
+    // (and parked streams are never resumed). It must be called with mu_ held.
+    void close() {
+        closed_ = true;
+        parked_.clear();
+    }
+    // reinit resets the read side, in preparation for the next frame
+    // (which may already be in the receive buffer).
     void reinit() {
-        in_.bytes.len = 0;
-        out_.bytes.len = 0;
         reqlen_ = 0;
-        cursor_ = 0;
+        rd_.reset();
         state_ = ugorji::conn::CONN_READY;
     }
 };
 
-// class reqFrame {
-// public:
-//     int fd_;
-//     slice_bytes r_;
-//     reqFrame(int fd, slice_bytes r) : fd_(fd), r_(r) {};
-//     ~reqFrame() {};
-// };
-
 class ReqHandler {
 private:
     Manager* mgr_;
+    Pool* pool_;
+    void decodeFast(reqFrame& f, char** err);
+    void handleFast(reqFrame& f, char** err);
+    void runStream(reqFrame& f, char** err);
+    void runFetch(reqFrame& f, char** err);
 public:
-    void handle(slice_bytes in, slice_bytes& out, char** err);
-    explicit ReqHandler(Manager* n) : mgr_(n) { }
+    void decode(reqFrame& f, char** err);
+    void handle(reqFrame& f, char** err);
+    // If pool is set, the per-db parts of a request spanning dbs are run on it in parallel.
+    explicit ReqHandler(Manager* n, Pool* pool = nullptr) : mgr_(n), pool_(pool) { }
     ~ReqHandler() { }
 };
 
+// ConnHandler services connections for ugorji::conn::Manager, which calls handleFd on socket events.
+// 
+// Other engines (e.g. io_uring) can do the socket I/O themselves, and use the *IovFd/*DoneFd
+// functions to move frames in and out of a connection (with x.mu_ held).
 class ConnHandler : public ugorji::conn::Handler {
-private:
+protected:
     ReqHandler* reqHdlr_;
-    char errbuf_[128] {};
+    Pool* pool_;
     std::mutex mu_;
-    std::unordered_map<int,std::unique_ptr<connFdStateMach>> clientfds_;
-    connFdStateMach& stateFor(int fd);
-    void doStartFd(connFdStateMach& x, std::string& err);
+    std::unordered_map<int,std::shared_ptr<connFdStateMach>> clientfds_;
+    std::shared_ptr<connFdStateMach> stateFor(int fd);
+    void serviceFd(connFdStateMach& x, std::string& err);
+    void runFd(std::shared_ptr<connFdStateMach> x, reqFrame& f);
+    bool doStartFd(connFdStateMach& x, std::string& err);
     void doReadFd(connFdStateMach& x, std::string& err);
     void doProcessFd(connFdStateMach& x, std::string& err);
     void doWriteFd(connFdStateMach& x, std::string& err);
-    // void stopFds();
+    void completeFd(connFdStateMach& x, uint64_t id, std::string& err);
+    flushResult streamFd(connFdStateMach& x, std::unique_ptr<reqFrame> c);
+    void resumeFd(connFdStateMach& x);
+    bool enableZerocopy(connFdStateMach& x);
+    void reapZerocopy(connFdStateMach& x);
+    void parseFd(connFdStateMach& x, std::string& err);
+    int readIovFd(connFdStateMach& x, struct iovec* iov);
+    void readDoneFd(connFdStateMach& x, struct iovec* iov, int niov, size_t n, std::string& err);
+    int writeIovFd(connFdStateMach& x, struct iovec** iov);
+    void wroteFd(connFdStateMach& x, size_t n, bool zc);
+    // readyFd is called (with x.mu_ held) once a response is queued up on the connection.
+    virtual void readyFd(connFdStateMach& x, std::string& err);
     void acceptFd(int fd, std::string& err);
 public:
-    explicit ConnHandler(ReqHandler* reqHdlr) : ugorji::conn::Handler(), reqHdlr_(reqHdlr) {}
+    // responses of at least this size are sent with MSG_ZEROCOPY (0 means never).
+    // Note that the kernel notifies us of completions via EPOLLERR on the socket.
+    size_t zerocopyMin_ = 0;
+    // If pool is nil, requests are run inline on the thread which read them.
+    ConnHandler(ReqHandler* reqHdlr, Pool* pool) : ugorji::conn::Handler(), reqHdlr_(reqHdlr), pool_(pool) {}
     ~ConnHandler() {} 
     void handleFd(int fd, std::string& err) override;
     void unregisterFd(int fd, std::string& err) override;
+    // stopFds closes all connections (on shutdown), dropping their in-flight requests and streams.
+    void stopFds();
 };
 
 }
 }
-
@@ -0,0 +1,123 @@
+#include <string_view>
+
+#include <ugorji/util/bigendian.h>
+
+#include "counter.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+// a full shard looks at up to this many of its least recently used entries for an idle one to evict
+const size_t COUNTER_EVICT_SCAN = 8;
+
+class Uint64AddOperator : public leveldb::AssociativeMergeOperator {
+public:
+    // Merge never fails, as a failed merge is corruption to rocksdb (failing reads of the key,
+    // and compactions). A value which is not 8 bytes (e.g. put over a counter while one of its
+    // merges was in flight) is taken as 0, and so is an operand which is not 8 bytes.
+    bool Merge(
+        const leveldb::Slice& /*key*/,
+        const leveldb::Slice* existing_value,
+        const leveldb::Slice& value,
+        std::string* new_value,
+        leveldb::Logger* /*logger*/
+    ) const override {
+        uint64_t v = 0;
+        if(existing_value != nullptr && existing_value->size() == 8) {
+            v = util_big_endian_read_uint64((uint8_t*)existing_value->data());
+        }
+        if(value.size() == 8) v += util_big_endian_read_uint64((uint8_t*)value.data());
+        new_value->resize(8);
+        util_big_endian_write_uint64((uint8_t*)&(*new_value)[0], v);
+        return true;
+    }
+    const char* Name() const override { return "ugorji.ndb.Uint64Add"; }
+};
+
+std::shared_ptr<leveldb::MergeOperator> uint64AddOperator() {
+    static std::shared_ptr<leveldb::MergeOperator> op = std::make_shared<Uint64AddOperator>();
+    return op;
+}
+
+CounterCache::CounterCache(size_t capacity, size_t numShards) {
+    if(numShards == 0) numShards = 1;
+    for(size_t i = 0; i < numShards; i++) shards_.push_back(std::make_unique<shard>());
+    shardCap_ = capacity / numShards;
+    if(shardCap_ == 0) shardCap_ = 1;
+}
+
+CounterCache::shard& CounterCache::shardFor(const leveldb::Slice& key) {
+    auto h = std::hash<std::string_view>()(std::string_view(key.data(), key.size()));
+    return *shards_[h % shards_.size()];
+}
+
+bool CounterCache::add(const leveldb::Slice& key, uint64_t delta, uint64_t* v, const uint64_t* base) {
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    auto skey = key.ToString();
+    auto it = s.m_.find(skey);
+    if(it != s.m_.end() && it->second.stale) return false;
+    if(it == s.m_.end()) {
+        if(base == nullptr) return false;
+        if(s.m_.size() >= shardCap_) s.evictOne();
+        it = s.m_.emplace(std::move(skey), entry{ *base, 0, false, {} }).first;
+        s.lru_.push_front(&it->first);
+        it->second.lru = s.lru_.begin();
+    } else {
+        s.lru_.splice(s.lru_.begin(), s.lru_, it->second.lru);
+    }
+    it->second.v += delta;
+    it->second.pending++;
+    *v = it->second.v;
+    return true;
+}
+
+void CounterCache::done(const leveldb::Slice& key) {
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    auto it = s.m_.find(key.ToString());
+    if(it == s.m_.end() || it->second.pending == 0) return;
+    if(--it->second.pending == 0 && it->second.stale) {
+        s.erase(it);
+        s.cv_.notify_all();
+    }
+}
+
+void CounterCache::invalidate(const leveldb::Slice& key) {
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    auto it = s.m_.find(key.ToString());
+    if(it == s.m_.end()) return;
+    if(it->second.pending == 0) s.erase(it);
+    else it->second.stale = true;
+}
+
+void CounterCache::shard::erase(std::unordered_map<std::string, entry>::iterator it) {
+    lru_.erase(it->second.lru);
+    m_.erase(it);
+}
+
+// evictOne evicts the least recently used entry with no merges pending. If the ones it looks at
+// all have merges pending, the shard goes over its capacity for now.
+void CounterCache::shard::evictOne() {
+    size_t n = 0;
+    for(auto p = lru_.rbegin(); p != lru_.rend() && n < COUNTER_EVICT_SCAN; ++p, ++n) {
+        auto it = m_.find(**p);
+        if(it->second.pending > 0) continue;
+        erase(it);
+        return;
+    }
+}
+
+void CounterCache::await(const leveldb::Slice& key) {
+    auto& s = shardFor(key);
+    std::unique_lock<std::mutex> lk(s.mu_);
+    auto skey = key.ToString();
+    s.cv_.wait(lk, [&s, &skey] {
+            auto it = s.m_.find(skey);
+            return it == s.m_.end() || !it->second.stale;
+        });
+}
+
+} //close namespace ndb
+} // close namespace ugorji
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+#include <rocksdb/merge_operator.h>
+
+namespace leveldb = rocksdb;
+
+namespace ugorji { 
+namespace ndb { 
+
+// uint64AddOperator returns the merge operator shared by all dbs, for incr/decr.
+// 
+// Values are 8-byte big-endian uint64s, and each operand is an 8-byte big-endian delta
+// added to it (a decr is the two's complement of the delta). Addition wraps, as incr/decr always has.
+// A missing value is taken as 0, as is one which is not 8 bytes (the merge never fails, so the key
+// stays readable). incr/decr itself rejects a counter whose value is not 8 bytes when it loads it.
+std::shared_ptr<leveldb::MergeOperator> uint64AddOperator();
+
+// CounterCache holds the current value of counters (incr/decr keys), so incr/decr can return
+// the next value without reading the db, and write just the delta as a merge.
+// 
+// It is split into shards (each with its own lock). An entry counts the merges added to it
+// which are not yet written, and is only evicted (to bound the size) once there are none, so that
+// a reload from the db always sees every delta it handed out. A full shard evicts its least
+// recently used idle entry to make room for a new one (so hot counters stay cached).
+// 
+// Invalidating an entry with merges pending only marks it stale: it misses from then on, and goes
+// once they are written. A reload first waits for that (see await), so it never reads the db
+// ahead of merges which counted the old value.
+//
+// Puts and deletes of a counter must invalidate it, as must a failed merge. Do not mix puts and
+// deletes with concurrent incr/decr of the same key.
+class CounterCache {
+private:
+    struct entry {
+        uint64_t v;
+        uint32_t pending;
+        bool stale;
+        std::list<const std::string*>::iterator lru; // its place in shard::lru_
+    };
+    class shard {
+    public:
+        std::mutex mu_;
+        std::condition_variable cv_; // signalled as stale entries go
+        std::unordered_map<std::string, entry> m_;
+        // lru_ has the keys of m_ (which stay put in it), most recently used first
+        std::list<const std::string*> lru_;
+        void erase(std::unordered_map<std::string, entry>::iterator it);
+        void evictOne();
+    };
+    std::vector<std::unique_ptr<shard>> shards_;
+    size_t shardCap_;
+    shard& shardFor(const leveldb::Slice& key);
+public:
+    // capacity is in number of counters, spread evenly across the shards.
+    explicit CounterCache(size_t capacity = 16384, size_t numShards = 16);
+    // add adds delta to a counter, setting v to the new value, and returns true.
+    // If the counter is not cached, it is set to *base (if base is given), else false is returned.
+    // A stale counter is never added to (false is returned).
+    // Each successful add must be followed by a call to done, once its merge is written (or failed).
+    bool add(const leveldb::Slice& key, uint64_t delta, uint64_t* v, const uint64_t* base = nullptr);
+    void done(const leveldb::Slice& key);
+    void invalidate(const leveldb::Slice& key);
+    // await waits till a stale counter is gone, i.e. its pending merges are all written.
+    void await(const leveldb::Slice& key);
+};
+
+} //close namespace ndb
+} // close namespace ugorji
@@ -0,0 +1,69 @@
+#pragma once
+
+// The fast protocol is a fixed-layout alternative to the binc encoded [id, method, params]
+// requests, which the server parses straight into slices (with no intermediate codec_value tree).
+//
+// A client opts in by sending the single byte FAST_PROTO_HELLO (in place of a frame header),
+// which the server acknowledges by writing the same byte back. All subsequent requests on the
+// connection are in the fast protocol. Framing is unchanged: a request is still preceded by
+// the count byte and its big-endian length.
+//
+// All ints are big-endian. bytes is a u32 length followed by that many bytes.
+//
+//   request:  u64 id, u8 op, then per op:
+//     'G':    u32 n, n x key bytes
+//     'N':    u8 incr, u16 delta, u16 initVal, key bytes
+//     'R':    u32 count, u64 initVal, key bytes
+//     'Q':    seekpos1 bytes, seekpos2 bytes, u8 kindid, u8 shapeid, u8 ancestorOnly,
+//             u8 withCursor, u8 lastFilterOp, u64 offset, u64 limit, [cursor bytes]
+//     'U':    u32 n, n x (key bytes, value bytes), u32 m, m x key bytes (to delete)
+//
+//   response: u32 length (of the rest), u64 id, error bytes (empty if none), then if no error:
+//     'G':    u32 n, n x value bytes (in order of the keys)
+//     'N':    u64 next value
+//     'R':    u64 start, u64 end (of the reserved range [start, end))
+//     'Q':    u32 n, n x row bytes, [cursor bytes (if the request had one; empty at the end)]
+//     'U':    nothing
+
+#include <vector>
+
+#include "ndb.h"
+
+namespace ugorji {
+namespace ndb {
+
+const uint8_t FAST_PROTO_HELLO = 0xFB;
+
+// fastReq is a request in the fast protocol, parsed in place (the slices point into the frame).
+class fastReq {
+public:
+    uint8_t op = 0;
+    std::vector<leveldb::Slice> keys;
+    std::vector<leveldb::Slice> values;
+    std::vector<leveldb::Slice> delkeys;
+    leveldb::Slice key;
+    bool incr = false;
+    uint16_t delta = 0;
+    uint64_t initVal = 0;
+    uint32_t count = 0;
+    leveldb::Slice seekpos1;
+    leveldb::Slice seekpos2;
+    uint8_t kindid = 0;
+    uint8_t shapeid = 0;
+    bool ancestorOnly = false;
+    bool withCursor = false;
+    uint8_t lastFilterOp = 0;
+    size_t offset = 0;
+    size_t limit = 0;
+    bool hasCursor = false;
+    leveldb::Slice cursor;
+    void reset() {
+        op = 0;
+        keys.clear();
+        values.clear();
+        delkeys.clear();
+    }
+};
+
+} //close namespace ndb
+} // close namespace ugorji
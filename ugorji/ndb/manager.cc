@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <string>
 
 #include <cstdio>
@@ -17,6 +18,9 @@
 #include <rocksdb/comparator.h>
 #include <rocksdb/write_batch.h>
 #include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
 
 #include "manager.h"
 
@@ -129,13 +133,26 @@ Ndb* Manager::ndbForKey(leveldb::Slice& key, std::string& err) {
 //     sw.writeLong((uint8_t*)a);
 // }
 
-Ndb* Manager::openDb(const std::string& dbdir, leveldb::Options& opt, std::string& err) {
+// openDb opens a db, and must be called with mu_ held.
+Ndb* Manager::openDb(const std::string& dbdir, leveldb::Options& opt, const dbConf& conf, std::string& err) {
     LOG(INFO, "Opening DB: %s ...", dbdir.c_str());
     
     ugorji::util::LockSetLock lsl;
     auto vs = std::vector<std::string>{"db-dir:" + dbdir};
     locks_.locksFor(vs, lsl);
     
+    opt.merge_operator = uint64AddOperator();
+    // a db can't be reopened with a different comparator, so this is fixed when it is created
+    if(conf.reverse) opt.comparator = leveldb::ReverseBytewiseComparator();
+    if(conf.prefixLen > 0) {
+        // prefix blooms in the memtable and sst files (along with whole key blooms for gets)
+        opt.prefix_extractor.reset(leveldb::NewFixedPrefixTransform(conf.prefixLen));
+        opt.memtable_prefix_bloom_size_ratio = 0.1;
+        leveldb::BlockBasedTableOptions topt;
+        topt.filter_policy.reset(leveldb::NewBloomFilterPolicy(10));
+        topt.whole_key_filtering = true;
+        opt.table_factory.reset(leveldb::NewBlockBasedTableFactory(topt));
+    }
     leveldb::DB* db = nullptr;
     leveldb::Status s = leveldb::DB::Open(opt, dbdir, &db);
     if(!s.ok() || db == nullptr) {
@@ -148,7 +165,15 @@ Ndb* Manager::openDb(const std::string& dbdir, leveldb::Options& opt, std::strin
     dbs_.push_back(std::move(xx));
     l->db_ = db;
     //l->wopt_.sync = 1;
-    l->wopt_.sync = 0;
+    l->wopt_.sync = (conf.syncMs < 0);
+    if(conf.syncMs > 0) {
+        l->syncIntervalMs_ = conf.syncMs;
+        if(!syncer_.joinable() && !closed_) syncer_ = std::thread(&Manager::runSyncer, this);
+    }
+    if(conf.rowCache > 0) l->rowCache_ = std::make_unique<RowCache>(conf.rowCache);
+    l->idLease_ = conf.idLease;
+    l->prefixLen_ = conf.prefixLen;
+    l->reverse_ = conf.reverse;
     LOG(INFO, "Successfully opened DB: %s", dbdir.c_str());
     return l;
 }
@@ -166,7 +191,12 @@ Ndb* Manager::indexDb(uint8_t index, std::string& err) {
             opt = dbiter3->second;
         }
         std::string dbdir = basedir_ + "/index-" + std::to_string(index);
-        n = openDb(dbdir, opt, err);
+        dbConf conf = defIndexConf_;
+        auto pc = indexPrefixLen_.find(index);
+        if(pc != indexPrefixLen_.end()) conf.prefixLen = pc->second;
+        auto rc = indexReverse_.find(index);
+        if(rc != indexReverse_.end()) conf.reverse = rc->second;
+        n = openDb(dbdir, opt, conf, err);
         if(n != nullptr) {
             indexDbs_[index] = n;
         }        
@@ -188,7 +218,7 @@ Ndb* Manager::shardDb(uint16_t shard, std::string& err) {
     if(dbiter == shardDbs_.end()) {
         leveldb::Options opt = defKindOption_;
         std::string dbdir = basedir_ + "/shard-" + std::to_string(shard);
-        n = openDb(dbdir, opt, err);
+        n = openDb(dbdir, opt, defKindConf_, err);
         if(n != nullptr) {
             shardDbs_[shard] = n;
         }
@@ -228,7 +258,16 @@ Ndb* Manager::perkindDb(uint16_t shard, uint8_t kind, std::string& err) {
         ensureDir(dbdir, err);
         if(err.size() > 0) return nullptr;
         //printf(">>>>>> shard: %d, kind: %d, dbdir: %s\n", shard, kind, dbdir.c_str());
-        n = openDb(dbdir, opt, err);
+        dbConf conf = defKindConf_;
+        auto rc = kindRowCache_.find(kind);
+        if(rc != kindRowCache_.end()) conf.rowCache = rc->second;
+        auto sc = kindSyncMs_.find(kind);
+        if(sc != kindSyncMs_.end()) conf.syncMs = sc->second;
+        auto lc = kindIdLease_.find(kind);
+        if(lc != kindIdLease_.end()) conf.idLease = lc->second;
+        auto pc = kindPrefixLen_.find(kind);
+        if(pc != kindPrefixLen_.end()) conf.prefixLen = pc->second;
+        n = openDb(dbdir, opt, conf, err);
         if(n != nullptr) {
             //(*m2)[kind] = n;
             m2->emplace(kind, n);
@@ -239,6 +278,132 @@ Ndb* Manager::perkindDb(uint16_t shard, uint8_t kind, std::string& err) {
     return n;
 }
 
+void Manager::rowCacheStats(RowCacheStats& s) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for(auto& db : dbs_) {
+        if(db->rowCache_ == nullptr) continue;
+        RowCacheStats s2 {};
+        db->rowCache_->stats(s2);
+        s.add(s2);
+    }
+}
+
+void Manager::syncStats(SyncStats& s) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for(auto& db : dbs_) {
+        if(db->syncIntervalMs_ <= 0) continue;
+        s.syncs += db->syncs_;
+        s.errors += db->syncErrors_;
+        s.lastMicros = std::max(s.lastMicros, (uint64_t)db->lastSyncMicros_);
+        s.maxMicros = std::max(s.maxMicros, (uint64_t)db->maxSyncMicros_);
+        s.lagMicros = std::max(s.lagMicros, db->syncLagMicros());
+    }
+}
+
+// runSyncer syncs the WAL of each db with a durability interval, once the interval elapses,
+// and releases expired snapshots (waking at least every second).
+// The syncs are done without holding mu_, which ndbForKey needs.
+void Manager::runSyncer() {
+    std::unique_lock<std::mutex> lk(mu_);
+    while(!closed_) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::seconds(1);
+        std::vector<Ndb*> due;
+        for(auto& db : dbs_) {
+            if(db->syncIntervalMs_ <= 0) continue;
+            if(db->nextSync_ <= now) {
+                due.push_back(db.get());
+                db->nextSync_ = now + std::chrono::milliseconds(db->syncIntervalMs_);
+            }
+            if(db->nextSync_ < next) next = db->nextSync_;
+        }
+        lk.unlock();
+        for(auto db : due) db->syncWal();
+        {
+            std::lock_guard<std::mutex> slk(snapMu_);
+            expireSnapshots();
+        }
+        lk.lock();
+        syncCv_.wait_until(lk, next, [this] { return closed_; });
+    }
+}
+
+void Manager::close() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if(closed_) return;
+        closed_ = true;
+        syncCv_.notify_all();
+    }
+    if(syncer_.joinable()) syncer_.join();
+    for(auto& db : dbs_) {
+        if(db->syncIntervalMs_ > 0) db->syncWal();
+    }
+}
+
+// default and max idle time (ttl) of a snapshot, in ms
+const uint32_t DEFAULT_SNAPSHOT_TTL_MS = 60 * 1000;
+const uint32_t MAX_SNAPSHOT_TTL_MS = 10 * 60 * 1000;
+
+uint64_t Manager::acquireSnapshot(uint32_t ttlMs) {
+    if(ttlMs == 0) ttlMs = DEFAULT_SNAPSHOT_TTL_MS;
+    if(ttlMs > MAX_SNAPSHOT_TTL_MS) ttlMs = MAX_SNAPSHOT_TTL_MS;
+    std::lock_guard<std::mutex> lk(snapMu_);
+    auto ttl = std::chrono::milliseconds(ttlMs);
+    auto token = ++lastSnapshot_;
+    snapshots_[token] = snapInfo{ std::chrono::steady_clock::now() + ttl, ttl };
+    // every open db is snapshotted now, so they all see the same point in time
+    std::lock_guard<std::mutex> lock(mu_);
+    for(auto& db : dbs_) db->snapshot(token);
+    if(!syncer_.joinable() && !closed_) syncer_ = std::thread(&Manager::runSyncer, this);
+    return token;
+}
+
+// The db snapshot is taken holding snapMu_, so a concurrent release can't miss it.
+std::shared_ptr<const leveldb::Snapshot> Manager::snapshotFor(Ndb* db, uint64_t token, std::string& err) {
+    std::lock_guard<std::mutex> lk(snapMu_);
+    auto now = std::chrono::steady_clock::now();
+    auto it = snapshots_.find(token);
+    if(it != snapshots_.end() && it->second.expiry <= now) {
+        // expired, but not yet swept up
+        releaseSnapshotLocked(token);
+        it = snapshots_.end();
+    }
+    if(it == snapshots_.end()) {
+        err = "Invalid snapshot token (released or expired): " + std::to_string(token);
+        return nullptr;
+    }
+    it->second.expiry = now + it->second.ttl;
+    return db->snapshot(token);
+}
+
+void Manager::releaseSnapshot(uint64_t token) {
+    std::lock_guard<std::mutex> lk(snapMu_);
+    releaseSnapshotLocked(token);
+}
+
+void Manager::releaseSnapshotLocked(uint64_t token) {
+    if(snapshots_.erase(token) == 0) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    for(auto& db : dbs_) db->releaseSnapshot(token);
+}
+
+// expireSnapshots releases the snapshots not used within their ttl (at most once a second).
+// It must be called with snapMu_ held.
+void Manager::expireSnapshots() {
+    auto now = std::chrono::steady_clock::now();
+    if(now < nextSnapSweep_) return;
+    nextSnapSweep_ = now + std::chrono::seconds(1);
+    std::vector<uint64_t> expired;
+    for(auto& e : snapshots_) {
+        if(e.second.expiry <= now) expired.push_back(e.first);
+    }
+    for(auto token : expired) {
+        LOG(INFO, "Releasing expired snapshot: %llu", (unsigned long long)token);
+        releaseSnapshotLocked(token);
+    }
+}
+
 // see doc.md for file format.
 void Manager::load(std::istream& fs) {
     std::string line("");
@@ -264,7 +429,53 @@ void Manager::load(std::istream& fs) {
                     n0 = n+1;
                 }
             }
-            if(s2 == "block_cache") {
+            if(s2 == "row_cache") {
+                // row cache size (in MB) for data dbs of a kind (or the shard dbs if default)
+                size_t sz = std::stoul(s1) * (1 << 20);
+                for(size_t i = 0; i < ss.size(); i++) {
+                    int k = -1;
+                    try { k = std::stoi(ss[i]); } catch(std::exception&) { }
+                    if(k != -1) kindRowCache_[k] = sz;
+                    else if(ss[i] == "default") defKindConf_.rowCache = sz;
+                }
+            } else if(s2 == "idgen_lease") {
+                // number of IDs leased at a time per ID-gen key, for data dbs of a kind (or default)
+                uint32_t sz = std::stoul(s1);
+                for(size_t i = 0; i < ss.size(); i++) {
+                    int k = -1;
+                    try { k = std::stoi(ss[i]); } catch(std::exception&) { }
+                    if(k != -1) kindIdLease_[k] = sz;
+                    else if(ss[i] == "default") defKindConf_.idLease = sz;
+                }
+            } else if(s2 == "prefix_bloom") {
+                // prefix length (in bytes) for the prefix extractor and bloom filters.
+                // Keys are kinds, default (for kinds), index (default for indexes) or index:<id>.
+                size_t sz = std::stoul(s1);
+                for(size_t i = 0; i < ss.size(); i++) {
+                    int k = -1;
+                    try { k = std::stoi(ss[i]); } catch(std::exception&) { }
+                    if(k != -1) kindPrefixLen_[k] = sz;
+                    else if(ss[i] == "default") defKindConf_.prefixLen = sz;
+                    else if(ss[i] == "index") defIndexConf_.prefixLen = sz;
+                    else if(ss[i].compare(0, 6, "index:") == 0) indexPrefixLen_[std::stoi(ss[i].substr(6))] = sz;
+                }
+            } else if(s2 == "index_order") {
+                // asc (default) or desc, for index dbs. Keys are index ids.
+                for(size_t i = 0; i < ss.size(); i++) indexReverse_[std::stoi(ss[i])] = (s1 == "desc");
+            } else if(s2 == "durability") {
+                // none, sync (every write), or an interval in ms for syncing the WAL in the background.
+                // Keys are kinds, default (for kinds) or index.
+                int ms = 0;
+                if(s1 == "sync") ms = -1;
+                else if(s1 != "none") ms = std::stoi(s1);
+                for(size_t i = 0; i < ss.size(); i++) {
+                    int k = -1;
+                    try { k = std::stoi(ss[i]); } catch(std::exception&) { }
+                    if(k != -1) kindSyncMs_[k] = ms;
+                    else if(ss[i] == "default") defKindConf_.syncMs = ms;
+                    else if(ss[i] == "index") defIndexConf_.syncMs = ms;
+                }
+            } else if(s2 == "block_cache") {
                 for(size_t i = 0; i < ss.size(); i++) {
                     auto c = leveldb::NewLRUCache(std::stoi(s1));
                     blockCache_[ss[i]] = c;
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "ndb.h"
+#include <thread>
+#include <condition_variable>
 #include <rocksdb/env.h>
 
 namespace ugorji { 
@@ -38,6 +40,24 @@ public:
     void Logv(const leveldb::InfoLogLevel log_level, const char* format, va_list ap) override;
 };
 
+// SyncStats are the WAL sync metrics of dbs synced in the background (durability interval).
+struct SyncStats {
+    uint64_t syncs;
+    uint64_t errors;
+    uint64_t lastMicros;  // duration of the most recent sync (max across dbs)
+    uint64_t maxMicros;   // longest sync so far
+    uint64_t lagMicros;   // age of the oldest write not yet synced (max across dbs)
+};
+
+// dbConf is the ndb-level configuration of a db (beyond its leveldb::Options).
+struct dbConf {
+    size_t rowCache = 0;  // bytes
+    int syncMs = 0;       // 0: never sync, -1: sync every write, > 0: sync the WAL every syncMs
+    uint32_t idLease = 0; // size of the blocks of IDs leased per ID-gen key (0: no leasing)
+    size_t prefixLen = 0; // length of the fixed prefix extractor (with bloom filters), 0 for none
+    bool reverse = false; // keys in descending order (reverse bytewise comparator)
+};
+
 class Manager {
 private:
     ugorji::util::LockSet locks_;
@@ -47,13 +67,37 @@ private:
     std::unordered_map<int, leveldb::Options> indexOptions_ ;
     leveldb::Options defKindOption_ ;
     leveldb::Options defIndexOption_ ;
+    // per-kind overrides of defKindConf_
+    std::unordered_map<int, size_t> kindRowCache_ ;
+    std::unordered_map<int, int> kindSyncMs_ ;
+    std::unordered_map<int, uint32_t> kindIdLease_ ;
+    std::unordered_map<int, size_t> kindPrefixLen_ ;
+    std::unordered_map<int, size_t> indexPrefixLen_ ;
+    std::unordered_map<int, bool> indexReverse_ ;
+    dbConf defKindConf_ ;
+    dbConf defIndexConf_ ;
+    std::thread syncer_;
+    std::condition_variable syncCv_;
+    bool closed_ = false;
+    void runSyncer();
+    // snapshot tokens, and when each expires (see acquireSnapshot)
+    struct snapInfo {
+        std::chrono::steady_clock::time_point expiry;
+        std::chrono::milliseconds ttl;
+    };
+    std::mutex snapMu_;
+    std::unordered_map<uint64_t, snapInfo> snapshots_;
+    uint64_t lastSnapshot_ = 0;
+    std::chrono::steady_clock::time_point nextSnapSweep_ {};
+    void expireSnapshots();
+    void releaseSnapshotLocked(uint64_t token);
     std::vector<std::shared_ptr<leveldb::Cache>> caches_;
     std::vector<std::shared_ptr<leveldb::Logger>> loggers_ ;
     std::unordered_map<uint8_t, Ndb*> indexDbs_ ;
     std::unordered_map<uint16_t, Ndb*> shardDbs_ ;
     std::unordered_map<uint16_t, std::unique_ptr<std::unordered_map<uint8_t, Ndb*>>> perkindDbs_;
     std::vector<std::unique_ptr<Ndb>> dbs_;
-    Ndb* openDb(const std::string& dbdir, leveldb::Options& opt, std::string& err);
+    Ndb* openDb(const std::string& dbdir, leveldb::Options& opt, const dbConf& conf, std::string& err);
     Ndb* shardDb(uint16_t shard, std::string& err);
     Ndb* perkindDb(uint16_t shard, uint8_t kind, std::string& err);
 public:
@@ -65,7 +109,20 @@ public:
     Ndb* indexDb(uint8_t index, std::string& err);
     void load(std::istream& initfs);
     Ndb* ndbForKey(leveldb::Slice& key, std::string& err);
-    ~Manager() {};
+    // rowCacheStats sums up the row cache stats of all open dbs.
+    void rowCacheStats(RowCacheStats& s);
+    void syncStats(SyncStats& s);
+    // acquireSnapshot returns a token for a snapshot of every open db, which reads (G and Q requests)
+    // can pass to see the dbs as they were when it was acquired (a db opened since is snapshotted
+    // at its first use). It is released (by the background syncer) if not used for ttlMs.
+    uint64_t acquireSnapshot(uint32_t ttlMs);
+    // snapshotFor returns the snapshot of db for a token (extending its ttl),
+    // or sets err if the token is unknown (i.e. released or expired).
+    std::shared_ptr<const leveldb::Snapshot> snapshotFor(Ndb* db, uint64_t token, std::string& err);
+    void releaseSnapshot(uint64_t token);
+    // close stops the background WAL syncer (and snapshot expiry), after a final sync.
+    void close();
+    ~Manager() { close(); };
 };
 
 void extractKeyParts(const uint8_t* ikey, 
@@ -22,9 +22,6 @@
 //     reqkey = ndb_XXX(...)
 //     ndb_release(&reqkey, 1)
 // 
-// TODO: 
-// - Need to add merge operator to be shared.
-// 
 
 extern "C" {
 
@@ -86,6 +83,7 @@ void ndb_once_init() {
     ndbc::opt.env = ndbc::env;
     // ndbc::opt.block_cache = ndbc::cache;
     ndbc::opt.create_if_missing = true;
+    ndbc::opt.merge_operator = ugorji::ndb::uint64AddOperator();
     ndbc::opt.max_background_compactions = cores;
     ndbc::opt.max_background_flushes = cores;
     // ndbc::opt.max_open_files = ;
@@ -260,13 +258,14 @@ uint32_t ndb_query(ndb_t* db,
     auto rkv = new ndbc::freeinfo;
     std::vector<slice_bytes_t> sls{};
     auto iterFn = [&] (leveldb::Slice& sl) { 
-        if(sl.size() == 0 || sl.data() == nullptr) return;
+        if(sl.size() == 0 || sl.data() == nullptr) return true;
         auto slarr = new char[sl.size()];
         memcpy(slarr, sl.data(), sl.size());
         sls.push_back(slice_bytes_t{slarr, sl.size()}); 
         if(NDB_DEBUG) std::cerr << ">>>>> callback: Query Res: slarr: " << (void*)slarr 
                                 << ", res: " << ndb_to_hex(slarr, sl.size()) << std::endl;
         rkv->arrBytes_.push_back(std::unique_ptr<char[]>(slarr));
+        return true;
     };
     std::string serr;
     db->rep->query(leveldb::Slice(seekpos1.v, seekpos1.len), 
@@ -1,5 +1,6 @@
 
 #include <vector>
+#include <algorithm>
 #include <string>
 
 #include <cstdio>
@@ -44,42 +45,35 @@ namespace ndb {
 
 const leveldb::Comparator* COMPARATOR = leveldb::BytewiseComparator();
 
-leveldb::Slice ndbEntityBytesFromSlice(
-    const uint8_t* ikey, 
-    const size_t sz,
-    const uint8_t kindid,
-    const uint8_t shapeid
-) {
-    size_t el = sz;
-    size_t discrim = ikey[0] >> 4;
-    switch(discrim) {
-    case D_IDGEN:
-        break;
-    case D_INDEX:
-        // It's index row. Check backwards till you see a zero just before a sequence of 8. 
-        // That shows demarcation.
-        for(int j = sz-1-8; j >= 0; j=j-8) {
-            if(ikey[j] == 0) {
-                el = sz - j - 1;
-                break;
-            }
+       
+void Ndb::gets(std::vector<leveldb::Slice>& keys, std::vector<std::string>* values, std::vector<std::string>* errs) {
+    std::vector<leveldb::Status> ss;
+    if(rowCache_ == nullptr) {
+        ss = db_->MultiGet(ropt_, keys, values);
+    } else {
+        // only look up the keys not in the row cache
+        size_t n = keys.size();
+        values->resize(n);
+        ss.resize(n);
+        std::vector<size_t> miss;
+        std::vector<uint64_t> tokens;
+        std::vector<leveldb::Slice> mkeys;
+        for(size_t i = 0; i < n; i++) {
+            uint64_t token;
+            if(rowCache_->get(keys[i], &(*values)[i], &token)) continue;
+            miss.push_back(i);
+            tokens.push_back(token);
+            mkeys.push_back(keys[i]);
         }
-        break;
-    case D_ENTITY:
-        // 2nd to last bytes is entity kind
-        // last byte is entity shape (top 5) and entry type (lower 3)
-        if(((0x07 & ikey[sz-1]) != E_DATA) ||
-           (shapeid != 0 && shapeid != (ikey[sz-1] >> 3)) ||
-           (kindid != 0 && kindid != ikey[sz-2])) {
-            return leveldb::Slice();
+        std::vector<std::string> mvals;
+        auto ms = db_->MultiGet(ropt_, mkeys, &mvals);
+        for(size_t j = 0; j < miss.size(); j++) {
+            auto i = miss[j];
+            if(ms[j].ok()) rowCache_->fill(keys[i], mvals[j], tokens[j]);
+            (*values)[i] = std::move(mvals[j]);
+            ss[i] = std::move(ms[j]);
         }
-        break;
     }
-    return leveldb::Slice((const char*)&(ikey[sz-el]), el);
-}
-       
-void Ndb::gets(std::vector<leveldb::Slice>& keys, std::vector<std::string>* values, std::vector<std::string>* errs) {
-    std::vector<leveldb::Status> ss = db_->MultiGet(ropt_, keys, values);
     for(size_t i = 0; i < ss.size(); i++) {
         // std::string tmp;
         if(ss[i].ok()) {
@@ -92,10 +86,66 @@ void Ndb::gets(std::vector<leveldb::Slice>& keys, std::vector<std::string>* valu
     }
 }
 
+// multiGet looks up n keys with one batched MultiGet. Values are pinned where possible
+// (instead of copied out), and blocks not in cache are read in parallel (async_io).
+// multiGet looks up n keys at once (as of snapshot if set, which bypasses the row cache).
+void Ndb::multiGet(size_t n, const leveldb::Slice* keys, leveldb::PinnableSlice* values, 
+                   leveldb::Status* statuses, const leveldb::Snapshot* snapshot) {
+    leveldb::ReadOptions ropt = ropt_;
+    ropt.async_io = true;
+    ropt.snapshot = snapshot;
+    if(rowCache_ == nullptr || snapshot != nullptr) {
+        db_->MultiGet(ropt, db_->DefaultColumnFamily(), n, keys, values, statuses);
+        return;
+    }
+    // only look up the keys not in the row cache
+    std::vector<size_t> miss;
+    std::vector<uint64_t> tokens;
+    std::vector<leveldb::Slice> mkeys;
+    for(size_t i = 0; i < n; i++) {
+        uint64_t token;
+        values[i].Reset();
+        if(rowCache_->get(keys[i], values[i].GetSelf(), &token)) {
+            values[i].PinSelf();
+            statuses[i] = leveldb::Status::OK();
+            continue;
+        }
+        miss.push_back(i);
+        tokens.push_back(token);
+        mkeys.push_back(keys[i]);
+    }
+    if(miss.empty()) return;
+    size_t m = miss.size();
+    std::vector<leveldb::PinnableSlice> mvals(m);
+    std::vector<leveldb::Status> ms(m);
+    db_->MultiGet(ropt, db_->DefaultColumnFamily(), m, mkeys.data(), mvals.data(), ms.data());
+    for(size_t j = 0; j < m; j++) {
+        auto i = miss[j];
+        if(ms[j].ok()) rowCache_->fill(keys[i], mvals[j], tokens[j]);
+        values[i] = std::move(mvals[j]);
+        statuses[i] = std::move(ms[j]);
+    }
+}
+
+std::shared_ptr<const leveldb::Snapshot> Ndb::snapshot(uint64_t token) {
+    std::lock_guard<std::mutex> lk(snapMu_);
+    auto& sp = snapshots_[token];
+    if(!sp) sp.reset(db_->GetSnapshot(), [db = db_] (const leveldb::Snapshot* s) { db->ReleaseSnapshot(s); });
+    return sp;
+}
+
+void Ndb::releaseSnapshot(uint64_t token) {
+    std::lock_guard<std::mutex> lk(snapMu_);
+    snapshots_.erase(token);
+}
+
 void Ndb::get(leveldb::Slice key, std::string& value, std::string& err) {
+    uint64_t token = 0;
+    if(rowCache_ != nullptr && rowCache_->get(key, &value, &token)) return;
     std::string tmp;
     leveldb::Status s = db_->Get(ropt_, key, &tmp);
     if(s.ok()) {
+        if(rowCache_ != nullptr) rowCache_->fill(key, tmp, token);
         value = std::move(tmp);
     } else if(s.IsNotFound()) {
         err = NOT_FOUND_ERROR;
@@ -120,27 +170,190 @@ void Ndb::getViaIter(leveldb::Iterator* iter, leveldb::Slice key,
     }
 }
 
+static int64_t steadyMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// syncWal flushes and syncs the WAL, if anything was written since the last sync.
+void Ndb::syncWal() {
+    auto since = unsyncedSince_.exchange(0);
+    if(since == 0) return;
+    auto t0 = steadyMicros();
+    leveldb::Status s = db_->FlushWAL(true);
+    uint64_t d = steadyMicros() - t0;
+    if(!s.ok()) {
+        syncErrors_++;
+        LOG(ERROR, "Error syncing WAL: %s", s.ToString().c_str());
+        // still unsynced: keep the original time, unless a write has set it since
+        int64_t z = 0;
+        unsyncedSince_.compare_exchange_strong(z, since);
+        return;
+    }
+    syncs_++;
+    lastSyncMicros_ = d;
+    if(d > maxSyncMicros_) maxSyncMicros_ = d;
+}
+
+// syncLagMicros is how long the oldest write not yet synced has been waiting.
+uint64_t Ndb::syncLagMicros() {
+    auto since = unsyncedSince_.load();
+    return (since == 0) ? 0 : steadyMicros() - since;
+}
+
+// max bytes (of keys and values) a leader merges into one group commit.
+// Writers past that wait for the next one.
+const size_t MAX_GROUP_COMMIT_BYTES = 4 << 20;
+
+// commit writes the puts, deletes and merges (if any) to the db as one atomic batch.
+// 
+// Concurrent commits are grouped: the first writer in the queue becomes the leader, merges
+// the batches of all writers queued up behind it into one WriteBatch, writes it (with a single
+// WAL sync if wopt_.sync), and completes them all together. The rest just wait for it.
+// Since the merged batch is written atomically, if it fails, all writers in the group fail.
+leveldb::Status Ndb::commit(
+    std::vector<leveldb::Slice>& putkeys,
+    std::vector<leveldb::Slice>& putvalues, 
+    std::vector<leveldb::Slice>& delkeys,
+    std::vector<leveldb::Slice>* mergekeys,
+    std::vector<leveldb::Slice>* mergevalues
+) {
+    commitReq w { &putkeys, &putvalues, &delkeys, mergekeys, mergevalues, leveldb::Status(), false };
+    std::unique_lock<std::mutex> lk(commitMu_);
+    commitQ_.push_back(&w);
+    commitCv_.wait(lk, [this, &w] { return w.done || (!committing_ && commitQ_.front() == &w); });
+    if(w.done) return w.s;
+    committing_ = true;
+    std::vector<commitReq*> group;
+    size_t sz = 0;
+    while(!commitQ_.empty() && (group.empty() || sz < MAX_GROUP_COMMIT_BYTES)) {
+        auto r = commitQ_.front();
+        commitQ_.pop_front();
+        group.push_back(r);
+        for(size_t i = 0; i < r->putkeys->size(); i++) sz += (*r->putkeys)[i].size() + (*r->putvalues)[i].size();
+        for(auto& k : *r->delkeys) sz += k.size();
+        if(r->mergekeys != nullptr) {
+            for(size_t i = 0; i < r->mergekeys->size(); i++) sz += (*r->mergekeys)[i].size() + (*r->mergevalues)[i].size();
+        }
+    }
+    lk.unlock();
+    leveldb::WriteBatch wb;
+    for(auto r : group) {
+        for(size_t i = 0; i < r->putkeys->size(); i++) wb.Put((*r->putkeys)[i], (*r->putvalues)[i]);
+        for(auto& k : *r->delkeys) wb.Delete(k);
+        if(r->mergekeys != nullptr) {
+            for(size_t i = 0; i < r->mergekeys->size(); i++) wb.Merge((*r->mergekeys)[i], (*r->mergevalues)[i]);
+        }
+    }
+    leveldb::Status s = db_->Write(wopt_, &wb);
+    if(s.ok() && syncIntervalMs_ > 0) {
+        int64_t z = 0;
+        unsyncedSince_.compare_exchange_strong(z, steadyMicros());
+    }
+    if(group.size() > 1) LOG(TRACE, "Group commit: #writers: %d, #bytes: %d", (int)group.size(), (int)sz);
+    lk.lock();
+    for(auto r : group) {
+        r->s = s;
+        r->done = true;
+    }
+    committing_ = false;
+    commitCv_.notify_all();
+    return s;
+}
+
 void Ndb::update(
     std::vector<leveldb::Slice>& putkeys,
     std::vector<leveldb::Slice>& putvalues, 
     std::vector<leveldb::Slice>& delkeys,
     std::string& err
 ) {
-    auto numputs = putkeys.size();
-    auto numdels = delkeys.size();
-    leveldb::WriteBatch wb;
-    for(size_t i = 0; i < numputs; i++) {
-        wb.Put(putkeys[i], putvalues[i]);
+    leveldb::Status s = commit(putkeys, putvalues, delkeys);
+    // merges may still be pending on these counters: invalidate only marks them stale, and
+    // the next incr/decr waits for those merges before reloading (see CounterCache::await).
+    for(auto& k : putkeys) counters_.invalidate(k);
+    for(auto& k : delkeys) counters_.invalidate(k);
+    if(idLease_ > 0) {
+        // only ID-gen keys have leases, so other writes don't touch leaseMu_
+        auto idgen = [] (const leveldb::Slice& k) { return k.size() > 0 && (((uint8_t)k[0]) >> 4) == D_IDGEN; };
+        bool any = std::any_of(putkeys.begin(), putkeys.end(), idgen) || 
+            std::any_of(delkeys.begin(), delkeys.end(), idgen);
+        if(any) {
+            std::lock_guard<std::mutex> lk(leaseMu_);
+            for(auto& k : putkeys) if(idgen(k)) dropLeaseLocked(k);
+            for(auto& k : delkeys) if(idgen(k)) dropLeaseLocked(k);
+        }
     }
-    for(size_t i = 0; i < numdels; i++) {
-        wb.Delete(delkeys[i]);
+    if(rowCache_ != nullptr) {
+        for(auto& k : putkeys) rowCache_->invalidate(k);
+        for(auto& k : delkeys) rowCache_->invalidate(k);
     }
-    leveldb::Status s = db_->Write(wopt_, &wb);
     if(!s.ok()) {
         err = std::move(s.ToString());
     }
 }
 
+// addCounter adds delta to a counter (an 8-byte big-endian uint64, initVal if missing),
+// setting v to the new value.
+// 
+// The new value comes from the counter cache (loaded from the db on a miss),
+// and just the delta is written, as a merge (see uint64AddOperator).
+// If the merge fails, the cached counter is invalidated, so it is reloaded from the db
+// (once the merges still pending on it are written) instead of counting the lost delta.
+void Ndb::addCounter(leveldb::Slice key, uint64_t delta, uint64_t initVal, uint64_t* v, std::string& err) {
+    uint64_t d = delta;
+    if(!counters_.add(key, delta, v)) {
+        //lock the key (with unlock after this is done) (RAII), so only one loads it
+        std::vector<std::string> skeys { std::string(key.data(), key.size()) };
+        ugorji::util::LockSetLock ls;
+        locks_.locksFor(skeys, ls);
+        counters_.await(key);
+        if(!counters_.add(key, delta, v)) {
+            uint64_t base(0);
+            std::string t;
+            leveldb::Status s = db_->Get(ropt_, key, &t);
+            if(s.ok()) {
+                if(t.size() != 8) {
+                    err = "Value for incr/decr must be 8-bytes. Got: " + 
+                        std::to_string(t.size()) + " bytes";
+                    return;
+                }
+                //big-endian binary decode this 8-byte value, into base
+                base = util_big_endian_read_uint64((uint8_t*)&t[0]);
+            } else if(s.IsNotFound()) {
+                // a merge into a missing value starts from 0, so the initial value goes with this delta
+                base = initVal;
+                d += initVal;
+            } else {
+                err = std::move(s.ToString());
+                return;
+            }
+            if(!counters_.add(key, delta, v, &base)) {
+                err = "IncrDecr: counter was invalidated while being loaded. Retry";
+                return;
+            }
+        }
+    }
+    //big-endian binary encode the delta, merge it in, and write success or failure.
+    char da[8];
+    util_big_endian_write_uint64((uint8_t*)da, d);
+    std::vector<leveldb::Slice> putkeys, putvalues, delkeys;
+    std::vector<leveldb::Slice> mergekeys { key };
+    std::vector<leveldb::Slice> mergevalues { leveldb::Slice(da, 8) };
+    leveldb::Status s = commit(putkeys, putvalues, delkeys, &mergekeys, &mergevalues);
+    if(!s.ok()) counters_.invalidate(key);
+    counters_.done(key);
+    if(rowCache_ != nullptr) rowCache_->invalidate(key);
+    if(!s.ok()) err = std::move(s.ToString());
+}
+
+// dropLeaseLocked drops the lease of an ID-gen key, with leaseMu_ held. The entry stays
+// (exhausted) with its gen bumped, so a block being reserved for the key meanwhile is not installed.
+void Ndb::dropLeaseLocked(const leveldb::Slice& key) {
+    auto& l = leases_[key.ToString()];
+    l.next = l.end;
+    l.gen++;
+}
+
 void Ndb::incrdecr(
     leveldb::Slice key,
     bool incr,
@@ -149,46 +362,89 @@ void Ndb::incrdecr(
     uint64_t* nextVal,
     std::string& err
 ) {
-    //typedef unsigned long long int uint64;
-    //lock the key (with unlock after this is done) (RAII)
-    std::vector<std::string> skeys { std::string(key.data(), key.size()) };
-    ugorji::util::LockSetLock ls;
-    locks_.locksFor(skeys, ls);
-    uint64_t v(0);
-    std::string t;
-    leveldb::Status s = db_->Get(ropt_, key, &t);
-    if(s.ok()) {
-        if(t.size() != 8) {
-            err = "Value for incr/decr must be 8-bytes. Got: " + 
-                std::to_string(t.size()) + " bytes";
-            return;
+    bool leased = idLease_ > 0 && key.size() > 0 && (((uint8_t)key[0]) >> 4) == D_IDGEN;
+    if(leased && incr) {
+        // Serve from the key's leased block of IDs, reserving a new block once it runs out.
+        // The IDs left in a block are skipped on a restart (or once the lease is dropped).
+        // The block is reserved (a db write) outside leaseMu_, which is only held to install it;
+        // if another caller installed a block meanwhile, the one with more IDs left is kept.
+        auto skey = key.ToString();
+        uint64_t gen = 0;
+        {
+            std::lock_guard<std::mutex> lk(leaseMu_);
+            auto it = leases_.find(skey);
+            if(it != leases_.end()) {
+                if(it->second.end - it->second.next >= delta) {
+                    it->second.next += delta;
+                    *nextVal = it->second.next;
+                    LOG(TRACE, "IncrDecr: sending out: %llu (leased)", *nextVal);
+                    return;
+                }
+                gen = it->second.gen;
+            }
         }
-        //big-endian binary decode this 8-byte value, into v
-        v = util_big_endian_read_uint64((uint8_t*)&t[0]);
-    } else if(s.IsNotFound()) {
-        v = initVal;
-    } else {
-        err = std::move(s.ToString());
+        uint64_t n = std::max((uint64_t)idLease_, (uint64_t)delta);
+        uint64_t end;
+        addCounter(key, n, initVal, &end, err);
+        if(!err.empty()) return;
+        idLease l { end - n + delta, end, gen };
+        *nextVal = l.next;
+        std::lock_guard<std::mutex> lk(leaseMu_);
+        // if the key's lease was dropped meanwhile (by a put, delete or decr of it),
+        // the block just serves this call
+        auto it = leases_.find(skey);
+        if(it == leases_.end()) {
+            if(gen == 0) leases_.emplace(std::move(skey), l);
+        } else if(it->second.gen == gen && it->second.end - it->second.next < l.end - l.next) {
+            it->second = l;
+        }
+        LOG(TRACE, "IncrDecr: sending out: %llu (leased)", *nextVal);
         return;
     }
-    if(incr) {
-        v += delta;
-    } else {
-        v -= delta;
-    }
-    //big-endian binary encode v, store it back, and write success or failure.
-    char va[8];
-    util_big_endian_write_uint64((uint8_t*)va, v);
-    s = db_->Put(wopt_, key, leveldb::Slice(va, 8));
-    LOG(TRACE, "IncrDecr: sending out: %llu, status: %s", v, s.ToString().c_str());
-    if(s.ok()) {
-        *nextVal = v;
-    } else {
-        err = std::move(s.ToString());
+    if(leased) {
+        // a decr goes to the db value, past any leased IDs
+        std::lock_guard<std::mutex> lk(leaseMu_);
+        dropLeaseLocked(key);
     }
+    uint64_t v(0);
+    addCounter(key, (incr ? (uint64_t)delta : -(uint64_t)delta), initVal, &v, err);
+    LOG(TRACE, "IncrDecr: sending out: %llu, err: %s", v, err.c_str());
+    if(err.empty()) *nextVal = v;
+}
+
+// reserve atomically reserves count values of a counter (initVal if missing), returning the
+// range [start, end) of them. e.g. the IDs of a batch of new entities.
+void Ndb::reserve(
+    leveldb::Slice key,
+    uint32_t count,
+    uint64_t initVal,
+    uint64_t* start,
+    uint64_t* end,
+    std::string& err
+) {
+    uint64_t v(0);
+    addCounter(key, count, initVal, &v, err);
+    if(!err.empty()) return;
+    // incr returns the last of the values it adds, so the range is one past the previous value
+    *start = v - count + 1;
+    *end = v + 1;
 }
 
 
+// prefixSuccessor sets s to the smallest key greater than every key prefixed by p,
+// returning false if there is none (p is all 0xff).
+static bool prefixSuccessor(const leveldb::Slice& p, std::string& s) {
+    s.assign(p.data(), p.size());
+    while(!s.empty()) {
+        if((uint8_t)s.back() != 0xff) {
+            s.back()++;
+            return true;
+        }
+        s.pop_back();
+    }
+    return false;
+}
+
 // This can query for ancestor-only queries (checking D_DATA section) 
 // or non-ancestor-only queries (checkin D_INDEXROW section).
 // 
@@ -217,7 +473,22 @@ void Ndb::incrdecr(
 // 
 // limit: says maximum number of rows to return.
 // offset: how many rows to after initial positioning.
-void Ndb::query(
+// pinIter: if set, the iterator is opened with pin_data and handed to the caller
+//          before the scan, so rows whose keys are pinned (see keyPinned) can be
+//          referenced till the caller is done with it, instead of copied in iterFn.
+// 
+// The iterator is bounded (iterate_lower_bound/iterate_upper_bound) to the keys the scan could
+// return: those with the discriminator of seekpos1, and for = and ancestor queries, those prefixed
+// by seekpos1. So rocksdb can skip files (and blocks) outside it instead of reading them.
+// 
+// snapshot: if set, the query reads the db as of it (e.g. so all pages of a query see the same data).
+// cursor: if set, and cursor->resume is not empty, the scan resumes just past the row the
+//         cursor was taken at (with no offset or skips), so a page costs the same however deep.
+//         cursor->next is set for the next page (see queryCursor).
+// 
+// queryStart validates a query, opens its iterator (into q.iter) and positions it at the first
+// row to check, returning false if there is none (or on error). See query.
+bool Ndb::queryStart(
     const leveldb::Slice seekpos1,
     leveldb::Slice seekpos2,
     const uint8_t kindid,
@@ -226,9 +497,11 @@ void Ndb::query(
     const bool withCursor,
     const uint8_t lastFilterOp,     
     const size_t offset,
-    const size_t limit,
-    std::function<void (leveldb::Slice&)> iterFn,
-    std::string& err
+    queryCursor* cursor,
+    const leveldb::Snapshot* snapshot,
+    queryScan& q,
+    std::string& err,
+    std::shared_ptr<leveldb::Iterator>* pinIter
 ) {
     uint8_t discrim = seekpos1[0] >> 4;
         
@@ -262,35 +535,90 @@ void Ndb::query(
         default:
             err = "ndb/leveldb: Invalid last filter operator: [" + 
                 std::to_string(char(lastFilterOp)) + "]";
-            return;
+            return false;
         }
     }
-    int numscans = 0;
-    size_t numResults = 0;
     if(withCursor) {
         skipOne = false;
         skipFirstMatch = false;
     }
-    leveldb::Status s;
+    q.cursor = cursor;
+    q.cursorFlags = (forward ? 1 : 0) | (ancestorOnlyC ? 2 : 0);
+    q.lastFilterOp = lastFilterOp;
+    leveldb::Slice resume;
+    if(cursor != nullptr && cursor->resume.size() > 0) {
+        if(cursor->resume.size() < 4 || cursor->resume[0] != 1 || 
+           (uint8_t)cursor->resume[1] != q.cursorFlags || (uint8_t)cursor->resume[2] != lastFilterOp) {
+            err = "ndb/leveldb: Invalid query cursor";
+            return false;
+        }
+        resume = leveldb::Slice(cursor->resume.data() + 3, cursor->resume.size() - 3);
+    }
+    q.seekpos1 = seekpos1;
+    q.seekpos2 = seekpos2;
+    q.discrim = discrim;
+    q.kindid = kindid;
+    q.shapeid = shapeid;
+    q.forward = forward;
+    q.reverse = reverse_;
+    q.stopIfNotMatch = stopIfNotMatch;
     leveldb::Slice ikey;
-    leveldb::Iterator* iter = db_->NewIterator(ropt_);
-    iterGuard iterg(iter);
-    if(!iter->status().ok()) goto finish;
-    iter->Seek(seekpos1);
-    //if(!iter->status().ok()) goto finish;
-    if(!iter->Valid()) goto finish;
+    leveldb::ReadOptions ropt = ropt_;
+    if(pinIter != nullptr) ropt.pin_data = true;
+    ropt.snapshot = snapshot;
+    q.bounds = std::make_shared<iterBounds>();
+    auto& b = *q.bounds;
+    if(forward) {
+        if(!(stopIfNotMatch && prefixSuccessor(seekpos1, b.upper)) && discrim < 0x0f) {
+            b.upper.assign(1, char((discrim + 1) << 4));
+        }
+    } else {
+        if(stopIfNotMatch) b.lower.assign(seekpos1.data(), seekpos1.size());
+        else b.lower.assign(1, char(discrim << 4));
+    }
+    // The bounds are in the db's order, so swap on a descending db. That makes the bytewise upper
+    // bound inclusive (it is never a key the scan returns), and the lower exclusive (it is only
+    // a whole key for = and ancestor queries, which never scan backward).
+    if(reverse_) std::swap(b.upper, b.lower);
+    if(!b.upper.empty()) {
+        b.upperSl = leveldb::Slice(b.upper);
+        ropt.iterate_upper_bound = &b.upperSl;
+    }
+    if(!b.lower.empty()) {
+        b.lowerSl = leveldb::Slice(b.lower);
+        ropt.iterate_lower_bound = &b.lowerSl;
+    }
+    // prefix seek only where the scan stays within one prefix
+    ropt.total_order_seek = !(prefixLen_ > 0 && stopIfNotMatch && seekpos1.size() >= prefixLen_);
+    leveldb::Iterator* iter = db_->NewIterator(ropt);
+    q.iter = iter;
+    if(pinIter != nullptr) {
+        // the bounds go with the iterator, which the caller holds onto past the scan
+        pinIter->reset(iter, [bounds = q.bounds] (leveldb::Iterator* it) { delete it; });
+    }
+    if(!iter->status().ok()) return false;
+    if(resume.size() > 0) {
+        // position just past the row the cursor was taken at (even if it has since been deleted)
+        if(forward) seekGE(iter, resume);
+        else seekLE(iter, resume);
+        if(iter->Valid() && iter->key() == resume) step(iter, forward);
+        return iter->Valid();
+    }
+    seekGE(iter, seekpos1);
+    //if(!iter->status().ok()) return false;
+    if(!iter->Valid()) return false;
     ikey = iter->key();
     //take care of <, <= and ancestor query
     if(skipOne) {
         if(forward) {
             if(ikey.size() >= seekpos1.size() && memcmp(seekpos1.data(), ikey.data(), seekpos1.size()) == 0) {
-                iter->Next();
+                step(iter, true);
             }
         } else {
-            iter->Prev();
+            step(iter, false);
         }
-        //if(!iter->status().ok()) goto finish;
-        if(!iter->Valid()) goto finish;
+        //if(!iter->status().ok()) return false;
+        if(!iter->Valid()) return false;
         ikey = iter->key();
     }
     if(skipFirstMatch) {
@@ -298,64 +626,57 @@ void Ndb::query(
         for( ; 
              ikey.size() >= seekpos1.size() && memcmp(seekpos1.data(), ikey.data(), seekpos1.size()) == 0; 
              ikey = iter->key()) {
-            if(forward) iter->Next();
-            else iter->Prev();
-            //if(!iter->status().ok()) goto finish;
-            if(!iter->Valid()) goto finish;
+            step(iter, forward);
+            //if(!iter->status().ok()) return false;
+            if(!iter->Valid()) return false;
         }
     }
     if(offset > 0) {
         for(size_t i = 0; i < offset; i++) {
-            if(forward) iter->Next();
-            else iter->Prev();
-            //if(!iter->status().ok()) goto finish;
-            if(!iter->Valid()) goto finish;
+            step(iter, forward);
+            //if(!iter->status().ok()) return false;
+            if(!iter->Valid()) return false;
         }
-        ikey = iter->key();
     }
-    while(numResults < limit) {
-        ++numscans;
-        // If outside the block for which this iteration is valid, break out.
-        // E.g. We're checking for indexes, but see an entity or idgen block.
-        uint8_t discrim2 = ikey[0] >> 4;
-        if(discrim != discrim2) {
-            goto finish;
-        }
-        if(stopIfNotMatch) {
-            if(ikey.size() < seekpos1.size() || memcmp(seekpos1.data(), ikey.data(), seekpos1.size()) != 0) {
-                goto finish;
-            }
-        }
-        // if end seekpos set and we're past it, finish
-        if(seekpos2.size() > 0) {
-            if(forward) {
-                if(memcmp(seekpos2.data(), ikey.data(), seekpos2.size()) > 0) {
-                    goto finish;
-                }
-            } else {
-                if(memcmp(seekpos2.data(), ikey.data(), seekpos2.size()) < 0) {
-                    goto finish;
-                }
-            } 
-        }
-            
-        leveldb::Slice nt = ndbEntityBytesFromSlice((uint8_t*)ikey.data(), ikey.size(), kindid, shapeid);
-        if(nt.size() != 0) {
-            iterFn(nt);
-            numResults++;
+    return true;
+}
+
+void Ndb::queryOpen(
+    const leveldb::Slice seekpos1,
+    leveldb::Slice seekpos2,
+    const uint8_t kindid,
+    const uint8_t shapeid,
+    const bool ancestorOnlyC,
+    const bool withCursor,
+    const uint8_t lastFilterOp,     
+    const size_t offset,
+    const size_t limit,
+    queryCursor* cursor,
+    const leveldb::Snapshot* snapshot,
+    queryScan& q,
+    std::shared_ptr<leveldb::Iterator>& iter,
+    std::string& err
+) {
+    q.limit = limit;
+    q.ended = !queryStart(seekpos1, seekpos2, kindid, shapeid, ancestorOnlyC, withCursor, 
+                          lastFilterOp, offset, cursor, snapshot, q, err, &iter);
+}
+
+void Ndb::queryFinish(queryScan& q, std::string& err) {
+    LOG(TRACE, "In Query: #scans: %d, #results: %d", q.numscans, (int)q.numResults);
+    if(q.cursor != nullptr) {
+        q.cursor->next.clear();
+        if(q.stopped && q.iter->Valid()) {
+            auto k = q.iter->key();
+            q.cursor->next.reserve(3 + k.size());
+            q.cursor->next.push_back(1);
+            q.cursor->next.push_back((char)q.cursorFlags);
+            q.cursor->next.push_back((char)q.lastFilterOp);
+            q.cursor->next.append(k.data(), k.size());
         }
-        // continue loop
-        if(forward) iter->Next();
-        else iter->Prev();
-        //if(!iter->status().ok()) goto finish;
-        if(!iter->Valid()) goto finish;
-        ikey = iter->key();            
-    }
-    
- finish:
-    LOG(TRACE, "In Query: #scans: %d, #results: %d", numscans, numResults);
-    if(!iter->status().ok()) {
-        err = std::move(iter->status().ToString());
+    }
+    if(q.iter != nullptr && !q.iter->status().ok()) {
+        err = std::move(q.iter->status().ToString());
     }
 }
 
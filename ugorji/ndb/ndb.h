@@ -3,9 +3,21 @@
 #define NDB_DEBUG 0
 
 #include <stdint.h>
+#include <cstring>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 #include <ugorji/util/lockset.h>
 #include <rocksdb/db.h>
 
+#include "rowcache.h"
+#include "counter.h"
+
 namespace leveldb = rocksdb;
 
 namespace ugorji { 
@@ -18,12 +30,147 @@ enum EntryType     { E_METADATA = 1, E_DATA, E_INDEXROW }; //Must match order in
 enum Discriminator { D_INDEX = 1, D_ENTITY, D_IDGEN };     //Must match order in ndb.go
 enum QueryFilterOp { F_EQ = 1, F_GTE, F_GT, F_LTE, F_LT }; //Must match order in app/appcore.go
 
+// iterBounds holds the iterate bounds of an iterator, which must outlive it.
+struct iterBounds {
+    std::string lower;
+    std::string upper;
+    leveldb::Slice lowerSl;
+    leveldb::Slice upperSl;
+};
+
+// queryCursor resumes a query where a previous page of it stopped, instead of skipping offset rows.
+// resume is the cursor returned by the previous page (empty for the first page), and next
+// is set to the cursor for the next page (empty if the scan ran to its end).
+// 
+// A cursor is opaque to clients. It is: u8 version, u8 flags (1: forward, 2: ancestorOnly),
+// u8 lastFilterOp, then the db key of the last row returned.
+struct queryCursor {
+    leveldb::Slice resume;
+    std::string next;
+};
+
+// queryScan is the state of a query scan, set up by Ndb::queryStart for the scan loop (queryLoop).
+struct queryScan {
+    leveldb::Iterator* iter = nullptr;
+    std::shared_ptr<iterBounds> bounds;
+    leveldb::Slice seekpos1;
+    leveldb::Slice seekpos2;
+    uint8_t discrim = 0;
+    uint8_t kindid = 0;
+    uint8_t shapeid = 0;
+    bool forward = true;
+    // reverse is set if the db is in descending order (see Ndb::reverse_)
+    bool reverse = false;
+    bool stopIfNotMatch = false;
+    size_t limit = 0;
+    size_t numResults = 0;
+    int numscans = 0;
+    // stopped is set if the scan stopped at a row it returned (so the iterator is still on it)
+    bool stopped = false;
+    // ended is set once the scan is done (see Ndb::queryRun)
+    bool ended = false;
+    queryCursor* cursor = nullptr;
+    uint8_t cursorFlags = 0;
+    uint8_t lastFilterOp = 0;
+};
+
+// commitReq is a set of writes waiting in an Ndb's group commit queue (see Ndb::commit).
+struct commitReq {
+    std::vector<leveldb::Slice>* putkeys;
+    std::vector<leveldb::Slice>* putvalues;
+    std::vector<leveldb::Slice>* delkeys;
+    std::vector<leveldb::Slice>* mergekeys;
+    std::vector<leveldb::Slice>* mergevalues;
+    leveldb::Status s;
+    bool done;
+};
+
 class Ndb {
+private:
+    std::mutex commitMu_;
+    std::condition_variable commitCv_;
+    std::deque<commitReq*> commitQ_;
+    bool committing_ = false;
+    leveldb::Status commit(
+        std::vector<leveldb::Slice>& putkeys,
+        std::vector<leveldb::Slice>& putvalues, 
+        std::vector<leveldb::Slice>& delkeys,
+        std::vector<leveldb::Slice>* mergekeys = nullptr,
+        std::vector<leveldb::Slice>* mergevalues = nullptr
+    );
+    // idLease is the leased block of IDs of an ID-gen key: (next, end]. gen counts the times
+    // it was dropped, so a block reserved across a drop is not installed (see incrdecr).
+    struct idLease {
+        uint64_t next = 0;
+        uint64_t end = 0;
+        uint64_t gen = 0;
+    };
+    std::mutex snapMu_;
+    std::unordered_map<uint64_t, std::shared_ptr<const leveldb::Snapshot>> snapshots_;
+    std::mutex leaseMu_;
+    std::unordered_map<std::string, idLease> leases_;
+    void dropLeaseLocked(const leveldb::Slice& key);
+    bool queryStart(
+        const leveldb::Slice seekpos1,
+        leveldb::Slice seekpos2,
+        const uint8_t kindid,
+        const uint8_t shapeid,
+        const bool ancestorOnlyC,
+        const bool withCursor,
+        const uint8_t lastFilterOp,     
+        const size_t offset,
+        queryCursor* cursor,
+        const leveldb::Snapshot* snapshot,
+        queryScan& q,
+        std::string& err,
+        std::shared_ptr<leveldb::Iterator>* pinIter
+    );
+    void queryFinish(queryScan& q, std::string& err);
+    void addCounter(leveldb::Slice key, uint64_t delta, uint64_t initVal, uint64_t* v, std::string& err);
 public:
     leveldb::DB* db_;
     leveldb::ReadOptions ropt_;
     leveldb::WriteOptions wopt_;
     ugorji::util::LockSet locks_;
+    // rowCache_, if set, caches values in front of get/gets/multiGet (see init.cfg row_cache)
+    std::unique_ptr<RowCache> rowCache_;
+    // counters_ has the current value of incr/decr keys, which are written as merges (see counter.h)
+    CounterCache counters_;
+    // idLease_, if > 0, is the size of the blocks of IDs which incr of an ID-gen key reserves
+    // at a time, serving the increments from memory till a block runs out (see init.cfg idgen_lease).
+    uint32_t idLease_ = 0;
+    // prefixLen_, if > 0, is the length of the db's fixed prefix extractor (see init.cfg prefix_bloom).
+    // Queries bounded to a prefix at least that long use prefix seeks (and so its bloom filters).
+    size_t prefixLen_ = 0;
+    // reverse_ is set if the db is in descending (reverse bytewise) order (see init.cfg index_order).
+    // Queries are in terms of bytewise order, so on such a db, < and <= walk it with Next,
+    // and the others with Prev.
+    bool reverse_ = false;
+    // step moves an iterator to the next key in bytewise order (if forward) or the previous one.
+    void step(leveldb::Iterator* iter, bool forward) {
+        if(forward != reverse_) iter->Next();
+        else iter->Prev();
+    }
+    // seekGE positions an iterator at the first key >= k (bytewise), and seekLE at the last key <= k.
+    void seekGE(leveldb::Iterator* iter, const leveldb::Slice& k) {
+        if(reverse_) iter->SeekForPrev(k);
+        else iter->Seek(k);
+    }
+    void seekLE(leveldb::Iterator* iter, const leveldb::Slice& k) {
+        if(reverse_) iter->Seek(k);
+        else iter->SeekForPrev(k);
+    }
+    // syncIntervalMs_, if > 0, has the WAL synced in the background that often (see Manager).
+    // The sync metrics are in micros.
+    int syncIntervalMs_ = 0;
+    std::chrono::steady_clock::time_point nextSync_ {};
+    std::atomic<int64_t> unsyncedSince_ {0}; // time of the first write since the last sync, or 0
+    std::atomic<uint64_t> syncs_ {0};
+    std::atomic<uint64_t> syncErrors_ {0};
+    std::atomic<uint64_t> lastSyncMicros_ {0};
+    std::atomic<uint64_t> maxSyncMicros_ {0};
+    void syncWal();
+    uint64_t syncLagMicros();
     void gets(
         std::vector<leveldb::Slice>& keys, 
         std::vector<std::string>* values, 
@@ -32,6 +179,13 @@ public:
         leveldb::Slice key, 
         std::string& value, std::string& err
     );
+    void multiGet(
+        size_t n,
+        const leveldb::Slice* keys,
+        leveldb::PinnableSlice* values,
+        leveldb::Status* statuses,
+        const leveldb::Snapshot* snapshot = nullptr
+    );
     void getViaIter(
         leveldb::Iterator* iter, 
         leveldb::Slice key, 
@@ -43,7 +197,30 @@ public:
         std::vector<leveldb::Slice>& delkeys,
         std::string& err
     );
-    void query(
+    // query calls iterFn (any callable taking a leveldb::Slice& and returning bool) for each row
+    // matching a query, and returns the number of rows. See queryLoop.
+    // With a sink which does nothing, it just counts the rows (reading only keys).
+    template<typename Sink>
+    size_t query(
+        const leveldb::Slice seekpos1,
+        leveldb::Slice seekpos2,
+        const uint8_t kindid,
+        const uint8_t shapeid,
+        const bool ancestorOnlyC,
+        const bool withCursor,
+        const uint8_t lastFilterOp,     
+        const size_t offset,
+        const size_t limit,
+        Sink&& iterFn,
+        std::string& err,
+        std::shared_ptr<leveldb::Iterator>* pinIter = nullptr,
+        queryCursor* cursor = nullptr,
+        const leveldb::Snapshot* snapshot = nullptr
+    );
+    // queryOpen sets up a query scan for queryRun, for a caller which suspends it part way
+    // (e.g. a streamed query waiting on its client). The iterator is opened with pin_data (see query),
+    // and handed back in iter, which must be held till the scan is done.
+    void queryOpen(
         const leveldb::Slice seekpos1,
         leveldb::Slice seekpos2,
         const uint8_t kindid,
@@ -53,9 +230,17 @@ public:
         const uint8_t lastFilterOp,     
         const size_t offset,
         const size_t limit,
-        std::function<void (leveldb::Slice&)> iterFn,
+        queryCursor* cursor,
+        const leveldb::Snapshot* snapshot,
+        queryScan& q,
+        std::shared_ptr<leveldb::Iterator>& iter,
         std::string& err
     );
+    // queryRun runs a scan set up by queryOpen till it ends, or iterFn returns false. That suspends it,
+    // keeping its iterator and position, and the next call resumes it just past the last row returned.
+    // It returns true once the scan has ended.
+    template<typename Sink>
+    bool queryRun(queryScan& q, Sink&& iterFn, std::string& err);
     void incrdecr(
         leveldb::Slice key,
         bool incr,
@@ -64,12 +249,33 @@ public:
         uint64_t* nextVal,
         std::string& err
     );
+    void reserve(
+        leveldb::Slice key,
+        uint32_t count,
+        uint64_t initVal,
+        uint64_t* start,
+        uint64_t* end,
+        std::string& err
+    );
+    // snapshot returns the db's snapshot for a snapshot token (see Manager::acquireSnapshot),
+    // taking it if the db has none for it yet. It stays valid while the returned pointer is held,
+    // even if released.
+    std::shared_ptr<const leveldb::Snapshot> snapshot(uint64_t token);
+    void releaseSnapshot(uint64_t token);
     ~Ndb() {
         // db_->CancelAllBackgroundWork(true);
+        snapshots_.clear();
         delete db_;
     }
 };
 
+// keyPinned says if the current key of an iterator opened with pin_data
+// stays valid for the lifetime of the iterator (and not just till it is moved).
+inline bool keyPinned(leveldb::Iterator* iter) {
+    std::string v;
+    return iter->GetProperty("rocksdb.iterator.is-key-pinned", &v).ok() && v == "1";
+}
+
 // iterGuard works to ensure the iterator, got from NewIterator, is deleted once out of scope
 class iterGuard {
 public:
@@ -78,6 +284,149 @@ public:
     ~iterGuard() { delete iter_; }
 };
 
+// ndbEntityBytesFromSlice returns the entity bytes of a key (or an empty slice
+// if it is an entity not matching kindid/shapeid, when set).
+inline leveldb::Slice ndbEntityBytesFromSlice(
+    const uint8_t* ikey, 
+    const size_t sz,
+    const uint8_t kindid,
+    const uint8_t shapeid
+) {
+    size_t el = sz;
+    size_t discrim = ikey[0] >> 4;
+    switch(discrim) {
+    case D_IDGEN:
+        break;
+    case D_INDEX:
+        // It's index row. Check backwards till you see a zero just before a sequence of 8. 
+        // That shows demarcation.
+        for(int j = sz-1-8; j >= 0; j=j-8) {
+            if(ikey[j] == 0) {
+                el = sz - j - 1;
+                break;
+            }
+        }
+        break;
+    case D_ENTITY:
+        // 2nd to last bytes is entity kind
+        // last byte is entity shape (top 5) and entry type (lower 3)
+        if(((0x07 & ikey[sz-1]) != E_DATA) ||
+           (shapeid != 0 && shapeid != (ikey[sz-1] >> 3)) ||
+           (kindid != 0 && kindid != ikey[sz-2])) {
+            return leveldb::Slice();
+        }
+        break;
+    }
+    return leveldb::Slice((const char*)&(ikey[sz-el]), el);
+}
+
+// queryLoop is the inner loop of a query, called once the iterator is positioned
+// at the first row to check. It is specialized on the direction (bytewise, and whether that
+// is Next on the db), whether to stop at the first key not prefixed by seekpos1, and whether
+// there is an end seekpos2, so each row only checks what applies to it, and the sink call is inlined.
+template<bool Forward, bool Next, bool StopIfNotMatch, bool HasEnd, typename Sink>
+inline void queryLoop(queryScan& q, Sink& iterFn) {
+    leveldb::Iterator* iter = q.iter;
+    const char* p1 = q.seekpos1.data();
+    const size_t n1 = q.seekpos1.size();
+    const char* p2 = q.seekpos2.data();
+    const size_t n2 = q.seekpos2.size();
+    leveldb::Slice ikey = iter->key();
+    while(q.numResults < q.limit) {
+        ++q.numscans;
+        // If outside the block for which this iteration is valid, break out.
+        // E.g. We're checking for indexes, but see an entity or idgen block.
+        if((((uint8_t)ikey[0]) >> 4) != q.discrim) return;
+        if(StopIfNotMatch) {
+            if(ikey.size() < n1 || memcmp(p1, ikey.data(), n1) != 0) return;
+        }
+        // if end seekpos set and we're past it, finish
+        if(HasEnd) {
+            int c = memcmp(p2, ikey.data(), n2);
+            if(Forward ? (c > 0) : (c < 0)) return;
+        }
+        leveldb::Slice nt = ndbEntityBytesFromSlice((uint8_t*)ikey.data(), ikey.size(), q.kindid, q.shapeid);
+        if(nt.size() != 0) {
+            q.numResults++;
+            // iterFn returns false to stop the scan early
+            if(!iterFn(nt) || q.numResults >= q.limit) {
+                q.stopped = true;
+                return;
+            }
+        }
+        if(Next) iter->Next();
+        else iter->Prev();
+        if(!iter->Valid()) return;
+        ikey = iter->key();
+    }
+}
+
+template<bool Forward, bool Next, bool StopIfNotMatch, typename Sink>
+inline void queryLoopEnd(queryScan& q, Sink& iterFn) {
+    if(q.seekpos2.size() > 0) queryLoop<Forward, Next, StopIfNotMatch, true>(q, iterFn);
+    else queryLoop<Forward, Next, StopIfNotMatch, false>(q, iterFn);
+}
+
+template<bool Forward, bool Next, typename Sink>
+inline void queryLoopStop(queryScan& q, Sink& iterFn) {
+    if(q.stopIfNotMatch) queryLoopEnd<Forward, Next, true>(q, iterFn);
+    else queryLoopEnd<Forward, Next, false>(q, iterFn);
+}
+
+template<bool Forward, typename Sink>
+inline void queryLoopDir(queryScan& q, Sink& iterFn) {
+    if(q.reverse) queryLoopStop<Forward, !Forward>(q, iterFn);
+    else queryLoopStop<Forward, Forward>(q, iterFn);
+}
+
+// See the notes on queryStart (in ndb.cc) for how each filter op positions and bounds the scan.
+template<typename Sink>
+size_t Ndb::query(
+    const leveldb::Slice seekpos1,
+    leveldb::Slice seekpos2,
+    const uint8_t kindid,
+    const uint8_t shapeid,
+    const bool ancestorOnlyC,
+    const bool withCursor,
+    const uint8_t lastFilterOp,     
+    const size_t offset,
+    const size_t limit,
+    Sink&& iterFn,
+    std::string& err,
+    std::shared_ptr<leveldb::Iterator>* pinIter,
+    queryCursor* cursor,
+    const leveldb::Snapshot* snapshot
+) {
+    queryScan q;
+    q.limit = limit;
+    bool ok = queryStart(seekpos1, seekpos2, kindid, shapeid, ancestorOnlyC, withCursor, 
+                         lastFilterOp, offset, cursor, snapshot, q, err, pinIter);
+    iterGuard iterg(pinIter == nullptr ? q.iter : nullptr);
+    if(ok) {
+        if(q.forward) queryLoopDir<true>(q, iterFn);
+        else queryLoopDir<false>(q, iterFn);
+    }
+    queryFinish(q, err);
+    return q.numResults;
+}
+
+template<typename Sink>
+bool Ndb::queryRun(queryScan& q, Sink&& iterFn, std::string& err) {
+    if(!q.ended && q.stopped) {
+        q.stopped = false;
+        step(q.iter, q.forward);
+        q.ended = !q.iter->Valid();
+    }
+    if(!q.ended) {
+        if(q.forward) queryLoopDir<true>(q, iterFn);
+        else queryLoopDir<false>(q, iterFn);
+        // the loop only stops short of its end (and limit) when iterFn asks it to
+        q.ended = !q.stopped || q.numResults >= q.limit;
+    }
+    if(q.ended) queryFinish(q, err);
+    return q.ended;
+}
+
 }
 }
 
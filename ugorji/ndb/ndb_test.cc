@@ -0,0 +1,176 @@
+// ndb_test checks the parts of ndb whose behaviour is easy to pin down outside a running server.
+// Run with: make test
+// Each check prints what failed, and the exit code is the number of failures.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <ugorji/codec/codec.h>
+#include <ugorji/codec/binc.h>
+#include <ugorji/util/bigendian.h>
+
+#include "conn.h"
+#include "ndb.h"
+
+namespace ugorji {
+namespace ndb {
+
+std::atomic<int> failures { 0 };
+
+#define CHECK(cond, ...) do {                                       \
+        if(!(cond)) {                                               \
+            failures++;                                             \
+            fprintf(stderr, "FAIL: %s:%d: ", __FILE__, __LINE__);   \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fprintf(stderr, "\n");                                  \
+        }                                                           \
+    } while(0)
+
+// checkBincHead checks that bincWriteLen writes what codec_binc_encode writes ahead of
+// the contentLen bytes of contents of v.
+void checkBincHead(codec_value* v, uint8_t vd, uint64_t n, size_t contentLen) {
+    slice_bytes enc {};
+    char* err = nullptr;
+    codec_binc_encode(v, &enc, &err);
+    CHECK(err == nullptr, "encode (vd: %u, n: %llu): %s", vd, (unsigned long long)n, err);
+    slice_bytes head {};
+    bincWriteLen(&head, vd, n);
+    bool ok = err == nullptr && enc.bytes.len == head.bytes.len + contentLen &&
+        memcmp(enc.bytes.v, head.bytes.v, head.bytes.len) == 0;
+    CHECK(ok, "bincWriteLen (vd: %u, n: %llu) does not match codec_binc_encode", vd, (unsigned long long)n);
+    free(enc.bytes.v);
+    free(head.bytes.v);
+}
+
+// testBincWriteLen compares bincWriteLen with the codec at each boundary of its length encoding.
+// An array of 2^32 values is too big to encode here, so arrays stop short of it.
+void testBincWriteLen() {
+    const uint64_t sizes[] = { 0, 11, 12, 255, 256, 65535, 65536, (uint64_t)1 << 32 };
+    size_t maxBytes = (size_t)1 << 32;
+    // zero pages, which are only backed by memory as the encoder copies them out
+    void* zeros = mmap(nullptr, maxBytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(zeros != MAP_FAILED, "mmap of %zu bytes failed", maxBytes);
+    if(zeros == MAP_FAILED) return;
+    for(auto n : sizes) {
+        codec_value v;
+        v.type = CODEC_VALUE_BYTES;
+        v.v.vBytes.bytes.v = (char*)zeros;
+        v.v.vBytes.bytes.len = n;
+        checkBincHead(&v, BINC_VD_BYTES, n, n);
+        if(n >= ((uint64_t)1 << 32)) continue;
+        codec_value nv;
+        nv.type = CODEC_VALUE_NIL;
+        nv.v.vNil = true;
+        slice_bytes nilEnc {};
+        char* err = nullptr;
+        codec_binc_encode(&nv, &nilEnc, &err);
+        size_t nilLen = nilEnc.bytes.len;
+        free(nilEnc.bytes.v);
+        std::vector<codec_value> nils(n, nv);
+        codec_value a;
+        a.type = CODEC_VALUE_ARRAY;
+        a.v.vArray.len = n;
+        a.v.vArray.v = nils.data();
+        checkBincHead(&a, BINC_VD_ARRAY, n, n * nilLen);
+    }
+    munmap(zeros, maxBytes);
+}
+
+// counterInDb reads the value of a counter straight from the db (0 if missing or bad).
+uint64_t counterInDb(Ndb& n, const std::string& key) {
+    std::string t;
+    auto s = n.db_->Get(leveldb::ReadOptions(), key, &t);
+    if(!s.ok() || t.size() != 8) return 0;
+    return util_big_endian_read_uint64((uint8_t*)&t[0]);
+}
+
+// testLeaseWithOtherPuts checks that leased incrs of an ID-gen key keep being served from
+// memory (i.e. the db's counter stays at the end of the first block) while other keys are
+// put alongside, and that a put of the ID-gen key itself drops its lease.
+void testLeaseWithOtherPuts() {
+    char dir[] = "/tmp/ndb_test_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr, "mkdtemp failed");
+    leveldb::Options opt;
+    opt.create_if_missing = true;
+    opt.merge_operator = uint64AddOperator();
+    leveldb::DB* db = nullptr;
+    auto s = leveldb::DB::Open(opt, dir, &db);
+    CHECK(s.ok(), "open %s: %s", dir, s.ToString().c_str());
+    if(!s.ok()) return;
+    {
+        const uint32_t lease = 1000;
+        const int incrs = 500;
+        Ndb n;
+        n.db_ = db;
+        n.idLease_ = lease;
+        std::string idKey(8, '\0');
+        idKey[0] = (char)(D_IDGEN << 4);
+        idKey[1] = 1;
+        uint64_t v = 0;
+        std::string err;
+        n.incrdecr(leveldb::Slice(idKey), true, 1, 0, &v, err);
+        CHECK(err.empty() && v == 1, "first incr: v: %llu, err: %s", (unsigned long long)v, err.c_str());
+        CHECK(counterInDb(n, idKey) == lease, "first block not reserved: %llu", 
+              (unsigned long long)counterInDb(n, idKey));
+        std::thread writer([&n, incrs] {
+                std::string werr;
+                for(int i = 0; i < incrs; i++) {
+                    std::string k(8, '\0');
+                    k[0] = (char)(D_ENTITY << 4);
+                    k[1] = 1;
+                    k[7] = (char)i;
+                    std::vector<leveldb::Slice> putkeys { leveldb::Slice(k) };
+                    std::vector<leveldb::Slice> putvalues { leveldb::Slice("v") };
+                    std::vector<leveldb::Slice> delkeys;
+                    n.update(putkeys, putvalues, delkeys, werr);
+                    CHECK(werr.empty(), "put: %s", werr.c_str());
+                }
+            });
+        uint64_t last = v;
+        for(int i = 0; i < incrs; i++) {
+            n.incrdecr(leveldb::Slice(idKey), true, 1, 0, &v, err);
+            CHECK(err.empty() && v == last + 1, "incr %d: v: %llu, want: %llu, err: %s", 
+                  i, (unsigned long long)v, (unsigned long long)last + 1, err.c_str());
+            last = v;
+        }
+        writer.join();
+        CHECK(counterInDb(n, idKey) == lease, "puts of other keys dropped the lease: db counter: %llu",
+              (unsigned long long)counterInDb(n, idKey));
+        // a put of the ID-gen key itself drops the lease, so the next incr reserves past it
+        char base[8];
+        util_big_endian_write_uint64((uint8_t*)base, 5000);
+        std::vector<leveldb::Slice> putkeys { leveldb::Slice(idKey) };
+        std::vector<leveldb::Slice> putvalues { leveldb::Slice(base, 8) };
+        std::vector<leveldb::Slice> delkeys;
+        n.update(putkeys, putvalues, delkeys, err);
+        CHECK(err.empty(), "put of ID-gen key: %s", err.c_str());
+        n.incrdecr(leveldb::Slice(idKey), true, 1, 0, &v, err);
+        CHECK(err.empty() && v == 5001, "incr after put: v: %llu, err: %s", (unsigned long long)v, err.c_str());
+        CHECK(counterInDb(n, idKey) == 5000 + lease, "block after put not reserved: %llu", 
+              (unsigned long long)counterInDb(n, idKey));
+        // ~Ndb closes db
+    }
+    leveldb::DestroyDB(dir, opt);
+    rmdir(dir);
+}
+
+} //close namespace ndb
+} // close namespace ugorji
+
+int main() {
+    using namespace ugorji::ndb;
+    testBincWriteLen();
+    testLeaseWithOtherPuts();
+    if(failures == 0) fprintf(stderr, "PASS\n");
+    return failures.load();
+}
@@ -0,0 +1,111 @@
+#include <ugorji/util/logging.h>
+
+#include "pool.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+// the pool (and the index into its workers) which the current thread works for, if any.
+thread_local Pool* tlsPool = nullptr;
+thread_local size_t tlsWorker = 0;
+
+Pool::Pool(size_t numWorkers) {
+    if(numWorkers == 0) numWorkers = std::thread::hardware_concurrency();
+    if(numWorkers == 0) numWorkers = 1;
+    for(size_t i = 0; i < numWorkers; i++) {
+        workers_.push_back(std::make_unique<worker>());
+    }
+    for(size_t i = 0; i < numWorkers; i++) {
+        threads_.emplace_back(&Pool::run, this, i);
+    }
+    LOG(INFO, "<pool> started %d workers", numWorkers);
+}
+
+void Pool::submit(std::function<void()> fn) {
+    size_t i = (tlsPool == this) ? tlsWorker : (next_++ % workers_.size());
+    // counted before it is visible to workers, so one taking it cannot decrement first
+    pending_++;
+    {
+        auto& w = *workers_[i];
+        std::lock_guard<std::mutex> lk(w.mu_);
+        w.q_.push_back(std::move(fn));
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    cv_.notify_one();
+}
+
+bool Pool::tryRun(size_t i) {
+    std::function<void()> fn;
+    size_t n = workers_.size();
+    for(size_t j = 0; j < n && !fn; j++) {
+        auto& w = *workers_[(i+j) % n];
+        std::lock_guard<std::mutex> lk(w.mu_);
+        if(w.q_.empty()) continue;
+        if(j == 0) {
+            fn = std::move(w.q_.back());
+            w.q_.pop_back();
+        } else {
+            fn = std::move(w.q_.front());
+            w.q_.pop_front();
+        }
+    }
+    if(!fn) return false;
+    pending_--;
+    fn();
+    return true;
+}
+
+void Pool::run(size_t i) {
+    tlsPool = this;
+    tlsWorker = i;
+    while(true) {
+        if(tryRun(i)) continue;
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [this] { return closed_ || pending_ > 0; });
+        if(closed_ && pending_ == 0) break;
+    }
+}
+
+void Pool::close() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if(closed_) return;
+        closed_ = true;
+        cv_.notify_all();
+    }
+    for(auto& t : threads_) t.join();
+    LOG(INFO, "<pool> stopped %d workers", threads_.size());
+}
+
+void TaskGroup::run(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lk(st_->mu_);
+        st_->q_.push_back(std::move(fn));
+    }
+    // the pool task runs whichever of the group's tasks is next (if any are left)
+    if(pool_ != nullptr) pool_->submit([st = st_] { st->runOne(); });
+}
+
+bool TaskGroup::state::runOne() {
+    std::function<void()> fn;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if(q_.empty()) return false;
+        fn = std::move(q_.front());
+        q_.pop_front();
+        running_++;
+    }
+    fn();
+    std::lock_guard<std::mutex> lk(mu_);
+    if(--running_ == 0 && q_.empty()) cv_.notify_all();
+    return true;
+}
+
+void TaskGroup::wait() {
+    while(st_->runOne()) { }
+    std::unique_lock<std::mutex> lk(st_->mu_);
+    st_->cv_.wait(lk, [this] { return st_->running_ == 0 && st_->q_.empty(); });
+}
+
+} //close namespace ndb
+} // close namespace ugorji
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+namespace ugorji { 
+namespace ndb { 
+
+// Pool is a work-stealing thread pool, which runs the database work for requests
+// (so the threads servicing sockets never block on a long query or a stalled write).
+// 
+// Each worker owns a deque of tasks. It takes from the back of its own deque,
+// and when that is empty, steals from the front of the other workers' deques.
+// Tasks submitted from a worker go onto its own deque, and others are spread round-robin.
+class Pool {
+private:
+    class worker {
+    public:
+        std::mutex mu_;
+        std::deque<std::function<void()>> q_;
+    };
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::atomic<size_t> pending_ {0};
+    std::atomic<size_t> next_ {0};
+    bool closed_ = false;
+    bool tryRun(size_t i);
+    void run(size_t i);
+public:
+    explicit Pool(size_t numWorkers);
+    ~Pool() { close(); }
+    void submit(std::function<void()> fn);
+    // close waits for all submitted tasks to run, and then stops the workers.
+    void close();
+    size_t size() { return workers_.size(); }
+};
+
+// TaskGroup runs a set of tasks in parallel on a pool, and waits for them all.
+// 
+// The waiting thread runs the group's tasks which no worker has picked up yet, so it is
+// never idle (and never deadlocks, even when it is itself a pool worker and all other workers
+// are busy). If the pool is nil, tasks are run inline by wait.
+class TaskGroup {
+private:
+    class state {
+    public:
+        std::mutex mu_;
+        std::condition_variable cv_;
+        std::deque<std::function<void()>> q_; // not yet picked up
+        size_t running_ = 0;
+        // runOne runs a task off q_, returning false if there was none.
+        bool runOne();
+    };
+    Pool* pool_;
+    // shared with the tasks submitted to the pool, which may run after wait returns
+    std::shared_ptr<state> st_;
+public:
+    explicit TaskGroup(Pool* pool) : pool_(pool), st_(std::make_shared<state>()) {}
+    ~TaskGroup() { wait(); }
+    void run(std::function<void()> fn);
+    void wait();
+};
+
+}
+}
@@ -0,0 +1,176 @@
+#include <unistd.h>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ugorji/util/logging.h>
+
+#include "reuseport.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+const int EPOLL_MAX_EVENTS = 256;
+
+epollLoop::~epollLoop() {
+    for(auto& x : conns_) {
+        if(x) ::close(x->fd_);
+    }
+    if(lfd_ >= 0) ::close(lfd_);
+    if(wakefd_ >= 0) ::close(wakefd_);
+    if(epfd_ >= 0) ::close(epfd_);
+}
+
+void epollLoop::open(std::string& err) {
+    lfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(lfd_ < 0) {
+        err = "<reuseport> socket: " + ugorji::conn::errnoStr();
+        return;
+    }
+    int one = 1;
+    ::setsockopt(lfd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(::setsockopt(lfd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        err = "<reuseport> SO_REUSEPORT: " + ugorji::conn::errnoStr();
+        return;
+    }
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if(::bind(lfd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(lfd_, SOMAXCONN) < 0) {
+        err = "<reuseport> bind/listen: " + ugorji::conn::errnoStr();
+        return;
+    }
+    wakefd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if(wakefd_ < 0 || epfd_ < 0) {
+        err = "<reuseport> eventfd/epoll_create: " + ugorji::conn::errnoStr();
+        return;
+    }
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = lfd_;
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, lfd_, &ev);
+    ev.data.fd = wakefd_;
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+}
+
+void epollLoop::acceptAll() {
+    while(true) {
+        int fd = ::accept4(lfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG(ERROR, "<reuseport> accept: %s", ugorji::conn::errnoStr().c_str());
+            }
+            return;
+        }
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if((size_t)fd >= conns_.size()) conns_.resize(fd + 1);
+        conns_[fd] = std::make_shared<connFdStateMach>(fd);
+        LOG(INFO, "Adding Connection Socket fd: %d", fd);
+        struct epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if(::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            closeConn(fd, "epoll_ctl: " + ugorji::conn::errnoStr());
+        }
+    }
+}
+
+void epollLoop::closeConn(int fd, const std::string& err) {
+    auto& x = conns_[fd];
+    LOG(INFO, "Removing socket fd: %d, reason: %s", fd, err.c_str());
+    ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    {
+        std::lock_guard<std::mutex> lk(x->mu_);
+        x->close();
+    }
+    x.reset();
+    ::close(fd);
+}
+
+void epollLoop::run(std::atomic<bool>& stop, std::string& err) {
+    struct epoll_event evs[EPOLL_MAX_EVENTS];
+    while(!stop) {
+        int n = ::epoll_wait(epfd_, evs, EPOLL_MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            err = "<reuseport> epoll_wait: " + ugorji::conn::errnoStr();
+            return;
+        }
+        for(int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            if(fd == lfd_) {
+                acceptAll();
+                continue;
+            }
+            if(fd == wakefd_) continue; // only used to wake us up to check stop
+            if((size_t)fd >= conns_.size() || !conns_[fd]) continue;
+            auto& x = *conns_[fd];
+            std::string err2;
+            {
+                std::lock_guard<std::mutex> lk(x.mu_);
+                // an error from running a request on the pool is reported on the next event for the fd
+                err2 = x.err_;
+                if(err2.empty()) serviceFd(x, err2);
+            }
+            if(!err2.empty()) closeConn(fd, err2);
+        }
+    }
+    // so requests still running (and parked streams) let go of them, before the pool is closed
+    for(size_t fd = 0; fd < conns_.size(); fd++) {
+        if(conns_[fd]) closeConn(fd, "server stopped");
+    }
+}
+
+void epollLoop::wake() {
+    uint64_t one = 1;
+    if(wakefd_ >= 0 && ::write(wakefd_, &one, sizeof(one)) < 0) { } // nothing to do
+}
+
+ReusePortServer::ReusePortServer(ReqHandler* reqHdlr, Pool* pool, int port, int numLoops, size_t zerocopyMin) {
+    if(numLoops <= 0) numLoops = std::thread::hardware_concurrency();
+    if(numLoops <= 0) numLoops = 1;
+    for(int i = 0; i < numLoops; i++) {
+        auto l = std::make_unique<epollLoop>(reqHdlr, pool, port);
+        l->zerocopyMin_ = zerocopyMin;
+        loops_.push_back(std::move(l));
+    }
+}
+
+void ReusePortServer::open(std::string& err) {
+    for(auto& l : loops_) {
+        l->open(err);
+        if(!err.empty()) return;
+    }
+    LOG(INFO, "<reuseport> listening on port with %d loops", (int)loops_.size());
+}
+
+void ReusePortServer::run(std::string& err) {
+    std::vector<std::string> errs(loops_.size());
+    std::vector<std::thread> thrs;
+    for(size_t i = 0; i < loops_.size(); i++) {
+        thrs.emplace_back([this, i, &errs] {
+                              loops_[i]->run(stop_, errs[i]);
+                              // if a loop fails, stop the others too
+                              if(!errs[i].empty()) close();
+                          });
+    }
+    for(size_t i = 0; i < thrs.size(); i++) {
+        thrs[i].join();
+        if(err.empty() && !errs[i].empty()) err = errs[i];
+    }
+}
+
+void ReusePortServer::close() {
+    stop_ = true;
+    for(auto& l : loops_) l->wake();
+}
+
+} //close namespace ndb
+} // close namespace ugorji
@@ -0,0 +1,52 @@
+#pragma once
+
+// ReusePortServer is an alternative to ugorji::conn::Manager, which runs N independent
+// accept/epoll loops (one per core). Each loop has its own listener bound with SO_REUSEPORT,
+// so the kernel spreads new connections across them, and a connection is serviced by the
+// loop which accepted it for its lifetime.
+
+#include <atomic>
+#include <thread>
+
+#include "conn.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+// epollLoop owns its connections in a table indexed by fd, which only its thread touches.
+// Socket events thus do not go through the shared clientfds_ map (or its mutex).
+class epollLoop : public ConnHandler {
+private:
+    int port_;
+    int lfd_ = -1;
+    int epfd_ = -1;
+    int wakefd_ = -1;
+    std::vector<std::shared_ptr<connFdStateMach>> conns_; // indexed by fd
+    void acceptAll();
+    void closeConn(int fd, const std::string& err);
+public:
+    epollLoop(ReqHandler* reqHdlr, Pool* pool, int port) : ConnHandler(reqHdlr, pool), port_(port) {}
+    ~epollLoop();
+    void open(std::string& err);
+    // run services connections on the calling thread, till stop is set and wake is called.
+    // It closes all connections on its way out.
+    void run(std::atomic<bool>& stop, std::string& err);
+    void wake();
+};
+
+class ReusePortServer {
+private:
+    std::vector<std::unique_ptr<epollLoop>> loops_;
+    std::atomic<bool> stop_ {false};
+public:
+    // numLoops <= 0 means one per core.
+    ReusePortServer(ReqHandler* reqHdlr, Pool* pool, int port, int numLoops, size_t zerocopyMin);
+    void open(std::string& err);
+    // run services connections on one thread per loop, till close is called.
+    void run(std::string& err);
+    // close is safe to call from a signal handler.
+    void close();
+};
+
+} //close namespace ndb
+} // close namespace ugorji
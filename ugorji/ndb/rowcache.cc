@@ -0,0 +1,87 @@
+#include <string_view>
+
+#include "rowcache.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+// approximate bookkeeping overhead of an entry (list node, map node, string headers)
+const size_t ROW_CACHE_ENTRY_OVERHEAD = 128;
+
+RowCache::RowCache(size_t capacity, size_t numShards) {
+    if(numShards == 0) numShards = 1;
+    for(size_t i = 0; i < numShards; i++) shards_.push_back(std::make_unique<shard>());
+    shardCap_ = capacity / numShards;
+}
+
+RowCache::shard& RowCache::shardFor(const leveldb::Slice& key) {
+    auto h = std::hash<std::string_view>()(std::string_view(key.data(), key.size()));
+    return *shards_[h % shards_.size()];
+}
+
+bool RowCache::get(const leveldb::Slice& key, std::string* value, uint64_t* token) {
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    auto it = s.m_.find(key.ToString());
+    if(it == s.m_.end()) {
+        *token = s.seq_;
+        misses_++;
+        return false;
+    }
+    s.lru_.splice(s.lru_.begin(), s.lru_, it->second);
+    value->assign(it->second->second);
+    hits_++;
+    return true;
+}
+
+void RowCache::fill(const leveldb::Slice& key, const leveldb::Slice& value, uint64_t token) {
+    size_t charge = key.size() + value.size() + ROW_CACHE_ENTRY_OVERHEAD;
+    // do not let one large value flush out a shard
+    if(charge > shardCap_ / 8) return;
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    if(s.seq_ != token) return;
+    auto skey = key.ToString();
+    if(s.m_.find(skey) != s.m_.end()) return;
+    s.lru_.emplace_front(skey, value.ToString());
+    s.m_.emplace(std::move(skey), s.lru_.begin());
+    s.bytes_ += charge;
+    fills_++;
+    while(s.bytes_ > shardCap_ && !s.lru_.empty()) {
+        auto& e = s.lru_.back();
+        s.bytes_ -= e.first.size() + e.second.size() + ROW_CACHE_ENTRY_OVERHEAD;
+        s.m_.erase(e.first);
+        s.lru_.pop_back();
+        evictions_++;
+    }
+}
+
+void RowCache::invalidate(const leveldb::Slice& key) {
+    auto& s = shardFor(key);
+    std::lock_guard<std::mutex> lk(s.mu_);
+    s.seq_++;
+    auto it = s.m_.find(key.ToString());
+    if(it == s.m_.end()) return;
+    s.bytes_ -= it->second->first.size() + it->second->second.size() + ROW_CACHE_ENTRY_OVERHEAD;
+    s.lru_.erase(it->second);
+    s.m_.erase(it);
+    invalidations_++;
+}
+
+void RowCache::stats(RowCacheStats& st) {
+    st.hits = hits_;
+    st.misses = misses_;
+    st.fills = fills_;
+    st.evictions = evictions_;
+    st.invalidations = invalidations_;
+    st.entries = 0;
+    st.bytes = 0;
+    for(auto& s : shards_) {
+        std::lock_guard<std::mutex> lk(s->mu_);
+        st.entries += s->m_.size();
+        st.bytes += s->bytes_;
+    }
+}
+
+} //close namespace ndb
+} // close namespace ugorji
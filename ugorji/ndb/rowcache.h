@@ -0,0 +1,75 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <rocksdb/slice.h>
+
+namespace leveldb = rocksdb;
+
+namespace ugorji { 
+namespace ndb { 
+
+struct RowCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fills;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t entries;
+    uint64_t bytes;
+    void add(const RowCacheStats& s) {
+        hits += s.hits;
+        misses += s.misses;
+        fills += s.fills;
+        evictions += s.evictions;
+        invalidations += s.invalidations;
+        entries += s.entries;
+        bytes += s.bytes;
+    }
+};
+
+// RowCache is an LRU cache of values in front of a db, split into shards (each with its own lock)
+// to keep contention down.
+// 
+// Writers invalidate keys after writing to the db. To keep a reader which missed from filling in
+// a value it read before such a write, each shard keeps a write sequence: a miss returns the
+// current one as a token, and fill only caches the value if the shard has not been written since.
+class RowCache {
+private:
+    class shard {
+    public:
+        std::mutex mu_;
+        // most recently used at the front
+        std::list<std::pair<std::string, std::string>> lru_;
+        std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> m_;
+        size_t bytes_ = 0;
+        uint64_t seq_ = 0;
+    };
+    std::vector<std::unique_ptr<shard>> shards_;
+    size_t shardCap_;
+    std::atomic<uint64_t> hits_ {0};
+    std::atomic<uint64_t> misses_ {0};
+    std::atomic<uint64_t> fills_ {0};
+    std::atomic<uint64_t> evictions_ {0};
+    std::atomic<uint64_t> invalidations_ {0};
+    shard& shardFor(const leveldb::Slice& key);
+public:
+    // capacity is in bytes (for keys and values), spread evenly across the shards.
+    explicit RowCache(size_t capacity, size_t numShards = 16);
+    // get returns true, with value set, on a hit. On a miss, token is set for a subsequent fill.
+    bool get(const leveldb::Slice& key, std::string* value, uint64_t* token);
+    // fill caches a value read from the db after a miss (unless invalidated since).
+    void fill(const leveldb::Slice& key, const leveldb::Slice& value, uint64_t token);
+    // invalidate drops a key. It must be called after the key is written to the db.
+    void invalidate(const leveldb::Slice& key);
+    void stats(RowCacheStats& s);
+};
+
+} //close namespace ndb
+} // close namespace ugorji
@@ -0,0 +1,331 @@
+#ifdef NDB_IO_URING
+
+#include <unistd.h>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <ugorji/util/logging.h>
+
+#include "uring.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+const unsigned URING_ENTRIES = 4096;
+
+// user_data for a submission is (fd << 8 | op)
+enum uringOp { U_ACCEPT = 1, U_WAKE, U_READ, U_WRITE };
+
+inline void uringSetData(struct io_uring_sqe* s, int fd, uringOp op) {
+    io_uring_sqe_set_data(s, (void*)(uintptr_t)(((uint64_t)fd << 8) | op));
+}
+
+inline std::string uringErr(const char* fn, int res) {
+    return std::string(fn) + ": " + strerror(-res);
+}
+
+UringServer::~UringServer() {
+    for(auto& c : conns_) {
+        if(c) ::close(c->x_->fd_);
+    }
+    if(ringInited_) io_uring_queue_exit(&ring_);
+    if(lfd_ >= 0) ::close(lfd_);
+    if(wakefd_ >= 0) ::close(wakefd_);
+}
+
+void UringServer::open(std::string& err) {
+    lfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(lfd_ < 0) {
+        err = "<uring> socket: " + ugorji::conn::errnoStr();
+        return;
+    }
+    int one = 1;
+    ::setsockopt(lfd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if(::bind(lfd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(lfd_, SOMAXCONN) < 0) {
+        err = "<uring> bind/listen: " + ugorji::conn::errnoStr();
+        return;
+    }
+    wakefd_ = ::eventfd(0, EFD_CLOEXEC);
+    if(wakefd_ < 0) {
+        err = "<uring> eventfd: " + ugorji::conn::errnoStr();
+        return;
+    }
+    int rc = io_uring_queue_init(URING_ENTRIES, &ring_, 0);
+    if(rc < 0) {
+        err = "<uring> " + uringErr("io_uring_queue_init", rc);
+        return;
+    }
+    ringInited_ = true;
+    if(numBufs_ > 0) {
+        bufs_.reset(new char[numBufs_ * RECV_BUF_SIZE]);
+        std::vector<struct iovec> iov(numBufs_);
+        for(size_t i = 0; i < numBufs_; i++) {
+            iov[i] = { &bufs_[i * RECV_BUF_SIZE], RECV_BUF_SIZE };
+            freeSlots_.push_back(numBufs_ - 1 - i);
+        }
+        rc = io_uring_register_buffers(&ring_, iov.data(), iov.size());
+        fixedBufs_ = (rc == 0);
+        if(!fixedBufs_) {
+            LOG(WARNING, "<uring> cannot register %d receive buffers (check RLIMIT_MEMLOCK): %s", 
+                (int)numBufs_, strerror(-rc));
+            freeSlots_.clear();
+            bufs_.reset();
+        }
+    }
+    LOG(INFO, "<uring> listening on port: %d, registered buffers: %d", port_, (int)freeSlots_.size());
+}
+
+struct io_uring_sqe* UringServer::sqe() {
+    auto s = io_uring_get_sqe(&ring_);
+    while(s == nullptr) {
+        io_uring_submit(&ring_);
+        s = io_uring_get_sqe(&ring_);
+    }
+    return s;
+}
+
+void UringServer::armAccept() {
+    auto s = sqe();
+    io_uring_prep_accept(s, lfd_, nullptr, nullptr, SOCK_CLOEXEC);
+    uringSetData(s, lfd_, U_ACCEPT);
+}
+
+void UringServer::armWake() {
+    auto s = sqe();
+    io_uring_prep_read(s, wakefd_, &wakebuf_, sizeof(wakebuf_), 0);
+    uringSetData(s, wakefd_, U_WAKE);
+}
+
+void UringServer::armRead(uringConn& c) {
+    if(c.reading_ || c.closing_) return;
+    auto& x = *c.x_;
+    std::string err;
+    {
+        std::lock_guard<std::mutex> lk(x.mu_);
+        parseFd(x, err);
+        if(err.empty()) {
+            // if at the pipeline limit, we resume once a response is queued up (see readyFd)
+            x.paused_ = x.pending() >= MAX_PIPELINED_FRAMES;
+            if(x.paused_) return;
+            c.rniov_ = readIovFd(x, c.riov_);
+        }
+    }
+    if(!err.empty()) {
+        closeConn(c, err);
+        return;
+    }
+    auto s = sqe();
+    if(c.rniov_ == 1 && c.slot_ >= 0) {
+        io_uring_prep_read_fixed(s, x.fd_, c.riov_[0].iov_base, c.riov_[0].iov_len, 0, c.slot_);
+    } else {
+        io_uring_prep_readv(s, x.fd_, c.riov_, c.rniov_, 0);
+    }
+    uringSetData(s, x.fd_, U_READ);
+    c.reading_ = true;
+}
+
+void UringServer::armWrite(uringConn& c) {
+    if(c.writing_ || c.closing_) return;
+    auto& x = *c.x_;
+    struct iovec* iov;
+    int niov;
+    {
+        // the iovecs stay put till we account for the write, as only this thread writes
+        std::lock_guard<std::mutex> lk(x.mu_);
+        niov = writeIovFd(x, &iov);
+    }
+    if(niov == 0) return;
+    auto s = sqe();
+    io_uring_prep_writev(s, x.fd_, iov, niov, 0);
+    uringSetData(s, x.fd_, U_WRITE);
+    c.writing_ = true;
+}
+
+void UringServer::onAccept(int res) {
+    if(!stop_) armAccept();
+    if(res < 0) {
+        LOG(ERROR, "<uring> %s", uringErr("accept", res).c_str());
+        return;
+    }
+    int fd = res;
+    if((size_t)fd >= conns_.size()) conns_.resize(fd + 1);
+    auto c = std::make_unique<uringConn>();
+    c->x_ = stateFor(fd);
+    if(!freeSlots_.empty()) {
+        c->slot_ = freeSlots_.back();
+        freeSlots_.pop_back();
+        auto& x = *c->x_;
+        x.rbuf_.bytes.v = &bufs_[c->slot_ * RECV_BUF_SIZE];
+        x.rbuf_.bytes.len = 0;
+        x.rbuf_.cap = RECV_BUF_SIZE;
+        x.rbufFixed_ = true;
+    }
+    auto& cc = *c;
+    conns_[fd] = std::move(c);
+    armRead(cc);
+}
+
+void UringServer::onRead(uringConn& c, int res) {
+    c.reading_ = false;
+    if(c.closing_) {
+        maybeFree(c);
+        return;
+    }
+    if(res == -EINTR || res == -EAGAIN) {
+        armRead(c);
+        return;
+    }
+    if(res <= 0) {
+        closeConn(c, (res == 0) ? "EOF" : uringErr("read", res));
+        return;
+    }
+    auto& x = *c.x_;
+    std::string err;
+    {
+        std::lock_guard<std::mutex> lk(x.mu_);
+        readDoneFd(x, c.riov_, c.rniov_, res, err);
+    }
+    if(!err.empty()) {
+        closeConn(c, err);
+        return;
+    }
+    armWrite(c);
+    armRead(c);
+}
+
+void UringServer::onWrite(uringConn& c, int res) {
+    c.writing_ = false;
+    if(c.closing_) {
+        maybeFree(c);
+        return;
+    }
+    if(res == -EINTR || res == -EAGAIN) {
+        armWrite(c);
+        return;
+    }
+    if(res < 0) {
+        closeConn(c, uringErr("write", res));
+        return;
+    }
+    auto& x = *c.x_;
+    bool paused;
+    {
+        std::lock_guard<std::mutex> lk(x.mu_);
+        wroteFd(x, res, false);
+        paused = x.paused_;
+    }
+    armWrite(c);
+    if(paused) armRead(c);
+}
+
+// onWake arms writes (and resumes paused reads) for connections with newly queued up responses.
+void UringServer::onWake() {
+    std::vector<std::shared_ptr<connFdStateMach>> xs;
+    {
+        std::lock_guard<std::mutex> lk(readyMu_);
+        xs.swap(ready_);
+    }
+    for(auto& x : xs) {
+        size_t fd = x->fd_;
+        // skip if closed since (and the fd possibly reused)
+        if(fd >= conns_.size() || !conns_[fd] || conns_[fd]->x_ != x) continue;
+        auto& c = *conns_[fd];
+        armWrite(c);
+        if(!c.closing_) armRead(c);
+    }
+}
+
+void UringServer::readyFd(connFdStateMach& x, std::string& err) {
+    {
+        std::lock_guard<std::mutex> lk(readyMu_);
+        ready_.push_back(x.shared_from_this());
+    }
+    // on the ring thread, the ready list is drained after each pass over completions
+    if(std::this_thread::get_id() != loopTid_) {
+        uint64_t one = 1;
+        if(::write(wakefd_, &one, sizeof(one)) < 0) {
+            LOG(ERROR, "<uring> cannot wake ring: %s", ugorji::conn::errnoStr().c_str());
+        }
+    }
+}
+
+void UringServer::closeConn(uringConn& c, const std::string& err) {
+    if(c.closing_) return;
+    c.closing_ = true;
+    auto fd = c.x_->fd_;
+    LOG(INFO, "<uring> closing fd: %d, reason: %s", fd, err.c_str());
+    std::string err2;
+    unregisterFd(fd, err2);
+    // complete any outstanding read/write, so we can close the fd
+    ::shutdown(fd, SHUT_RDWR);
+    maybeFree(c);
+}
+
+// maybeFree closes the fd once no reads or writes are outstanding on it.
+// Note that c is invalid once this closes it.
+void UringServer::maybeFree(uringConn& c) {
+    if(c.reading_ || c.writing_) return;
+    auto fd = c.x_->fd_;
+    ::close(fd);
+    if(c.slot_ >= 0) freeSlots_.push_back(c.slot_);
+    conns_[fd].reset();
+}
+
+void UringServer::run(std::string& err) {
+    loopTid_ = std::this_thread::get_id();
+    armAccept();
+    armWake();
+    while(!stop_) {
+        int rc = io_uring_submit_and_wait(&ring_, 1);
+        if(rc < 0 && rc != -EINTR) {
+            err = "<uring> " + uringErr("io_uring_submit_and_wait", rc);
+            break;
+        }
+        struct io_uring_cqe* cqe;
+        unsigned head;
+        unsigned n = 0;
+        io_uring_for_each_cqe(&ring_, head, cqe) {
+            n++;
+            auto d = (uint64_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+            size_t fd = d >> 8;
+            switch(d & 0xff) {
+            case U_ACCEPT:
+                onAccept(cqe->res);
+                break;
+            case U_WAKE:
+                onWake();
+                if(!stop_) armWake();
+                break;
+            case U_READ:
+                if(fd < conns_.size() && conns_[fd]) onRead(*conns_[fd], cqe->res);
+                break;
+            case U_WRITE:
+                if(fd < conns_.size() && conns_[fd]) onWrite(*conns_[fd], cqe->res);
+                break;
+            }
+        }
+        io_uring_cq_advance(&ring_, n);
+        onWake();
+    }
+    // so requests still running (and parked streams) let go of them, before the pool is closed.
+    // The fds are closed with the server.
+    stopFds();
+    LOG(INFO, "<uring> stopped", 0);
+}
+
+void UringServer::close() {
+    stop_ = true;
+    uint64_t one = 1;
+    if(wakefd_ >= 0 && ::write(wakefd_, &one, sizeof(one)) < 0) { } // nothing to do
+}
+
+} //close namespace ndb
+} // close namespace ugorji
+
+#endif // NDB_IO_URING
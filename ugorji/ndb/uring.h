@@ -0,0 +1,85 @@
+#pragma once
+
+// UringServer is an alternative to ugorji::conn::Manager (epoll), which uses io_uring to
+// accept connections and do all socket reads and writes. It is only built if NDB_IO_URING is set.
+
+#ifdef NDB_IO_URING
+
+#include <atomic>
+#include <thread>
+#include <liburing.h>
+
+#include "conn.h"
+
+namespace ugorji { 
+namespace ndb { 
+
+// uringConn is the engine state for a connection. It is only accessed from the ring thread.
+class uringConn {
+public:
+    std::shared_ptr<connFdStateMach> x_;
+    struct iovec riov_[2];
+    int rniov_ = 0;
+    int slot_ = -1;      // index of registered buffer used as the receive buffer, or -1
+    bool reading_ = false;
+    bool writing_ = false;
+    bool closing_ = false;
+};
+
+// UringServer runs a single io_uring on the calling thread. Submissions for all fds
+// (accept, reads, writes) are batched into one io_uring_submit per pass over completions.
+// 
+// Each connection reads into a receive buffer carved out of one region registered with the ring
+// (so reads are IORING_OP_READ_FIXED), unless it is in the middle of a large frame (where we readv
+// the rest of the frame straight into its buffer). Responses are written with IORING_OP_WRITEV,
+// as they reference pinned rows in place.
+// 
+// Requests are run on the execution pool. Completed responses are handed back to the ring thread
+// via a queue and an eventfd, as only the ring thread submits I/O.
+class UringServer : public ConnHandler {
+private:
+    int port_;
+    size_t numBufs_;
+    int lfd_ = -1;
+    int wakefd_ = -1;
+    uint64_t wakebuf_ = 0;
+    struct io_uring ring_ {};
+    bool ringInited_ = false;
+    bool fixedBufs_ = false;
+    std::unique_ptr<char[]> bufs_;
+    std::vector<int> freeSlots_;
+    std::vector<std::unique_ptr<uringConn>> conns_; // indexed by fd
+    std::atomic<bool> stop_ {false};
+    std::thread::id loopTid_;
+    std::mutex readyMu_;
+    std::vector<std::shared_ptr<connFdStateMach>> ready_;
+    struct io_uring_sqe* sqe();
+    void armAccept();
+    void armWake();
+    void armRead(uringConn& c);
+    void armWrite(uringConn& c);
+    void onAccept(int res);
+    void onRead(uringConn& c, int res);
+    void onWrite(uringConn& c, int res);
+    void onWake();
+    void closeConn(uringConn& c, const std::string& err);
+    void maybeFree(uringConn& c);
+protected:
+    void readyFd(connFdStateMach& x, std::string& err) override;
+public:
+    // numBufs is the number of registered receive buffers (each RECV_BUF_SIZE bytes).
+    // Connections beyond that use regular (unregistered) buffers.
+    UringServer(ReqHandler* reqHdlr, Pool* pool, int port, size_t numBufs) : 
+        ConnHandler(reqHdlr, pool), port_(port), numBufs_(numBufs) {}
+    ~UringServer();
+    void open(std::string& err);
+    // run services connections on the calling thread, till close is called.
+    void run(std::string& err);
+    // close is safe to call from a signal handler.
+    void close();
+};
+
+} //close namespace ndb
+} // close namespace ugorji
+
+#endif // NDB_IO_URING